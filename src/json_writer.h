@@ -0,0 +1,155 @@
+/*
+ * JSON writer shared by the firmware and the host benchmark (tools/bench_json.c)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// JSON writer
+// Streams JSON into a sink (a fixed buffer, or an HTTP chunk writer) and takes
+// care of separators and string escaping, so producers never hand-assemble
+// format strings. No allocation; keys are expected to be literals and are not
+// escaped. jw_members() splices a trusted pre-rendered member list.
+typedef void (*json_sink_fn)(void *ctx, const char *data, int len);
+
+typedef struct {
+    json_sink_fn sink;
+    void *ctx;
+    bool first;  // Next member is the first of its object/array
+} json_writer_t;
+
+typedef struct {
+    char *buf;
+    int cap;
+    int len;  // Bytes produced; >= cap means truncated
+} json_buf_t;
+
+static void json_buf_sink(void *ctx, const char *data, int len) {
+    json_buf_t *b = ctx;
+    int room = b->cap - 1 - b->len;
+    if (room > 0) memcpy(b->buf + b->len, data, len < room ? len : room);
+    b->len += len;
+    b->buf[b->len < b->cap ? b->len : b->cap - 1] = 0;
+}
+
+static void jw_init(json_writer_t *w, json_sink_fn sink, void *ctx) {
+    w->sink = sink;
+    w->ctx = ctx;
+    w->first = true;
+}
+
+static void jw_init_buf(json_writer_t *w, json_buf_t *b, char *buf, int cap) {
+    b->buf = buf;
+    b->cap = cap;
+    b->len = 0;
+    buf[0] = 0;
+    jw_init(w, json_buf_sink, b);
+}
+
+static bool json_buf_ok(const json_buf_t *b) {
+    return b->len < b->cap;
+}
+
+static void jw_raw(json_writer_t *w, const char *s, int len) {
+    w->sink(w->ctx, s, len);
+}
+
+static void jw_key(json_writer_t *w, const char *key) {
+    if (!w->first) jw_raw(w, ",", 1);
+    w->first = false;
+    if (!key) return;
+    jw_raw(w, "\"", 1);
+    jw_raw(w, key, strlen(key));
+    jw_raw(w, "\":", 2);
+}
+
+// Quoted string; runs of plain characters go to the sink in one piece
+static void jw_quoted(json_writer_t *w, const char *s) {
+    jw_raw(w, "\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        if (s > run) jw_raw(w, run, s - run);
+        char e[8];
+        int n = c == '"' || c == '\\' ? snprintf(e, sizeof(e), "\\%c", c) : snprintf(e, sizeof(e), "\\u%04x", c);
+        jw_raw(w, e, n);
+        run = s + 1;
+    }
+    if (s > run) jw_raw(w, run, s - run);
+    jw_raw(w, "\"", 1);
+}
+
+static void jw_obj(json_writer_t *w, const char *key) {
+    jw_key(w, key);
+    jw_raw(w, "{", 1);
+    w->first = true;
+}
+
+static void jw_obj_end(json_writer_t *w) {
+    jw_raw(w, "}", 1);
+    w->first = false;
+}
+
+static void jw_arr(json_writer_t *w, const char *key) {
+    jw_key(w, key);
+    jw_raw(w, "[", 1);
+    w->first = true;
+}
+
+static void jw_arr_end(json_writer_t *w) {
+    jw_raw(w, "]", 1);
+    w->first = false;
+}
+
+static void jw_str(json_writer_t *w, const char *key, const char *val) {
+    jw_key(w, key);
+    jw_quoted(w, val);
+}
+
+static void jw_uint(json_writer_t *w, const char *key, unsigned long v) {
+    char t[12];
+    int n = 0;
+    do {
+        t[sizeof(t) - ++n] = '0' + v % 10;
+    } while (v /= 10);
+    jw_key(w, key);
+    jw_raw(w, t + sizeof(t) - n, n);
+}
+
+static void jw_int(json_writer_t *w, const char *key, long v) {
+    if (v >= 0) {
+        jw_uint(w, key, v);
+        return;
+    }
+    jw_key(w, key);
+    jw_raw(w, "-", 1);
+    w->first = true;  // The digits follow without a separator
+    jw_uint(w, NULL, -(unsigned long)v);
+}
+
+static void jw_bool(json_writer_t *w, const char *key, bool v) {
+    jw_key(w, key);
+    jw_raw(w, v ? "true" : "false", v ? 4 : 5);
+}
+
+static void jw_null(json_writer_t *w, const char *key) {
+    jw_key(w, key);
+    jw_raw(w, "null", 4);
+}
+
+// Value that is already valid JSON (e.g. a rendered number)
+static void jw_value(json_writer_t *w, const char *key, const char *json) {
+    jw_key(w, key);
+    jw_raw(w, json, strlen(json));
+}
+
+// "a":1,"b":[..] member list from a trusted constant
+static void jw_members(json_writer_t *w, const char *members) {
+    if (!*members) return;
+    jw_key(w, NULL);
+    jw_raw(w, members, strlen(members));
+}
@@ -3,13 +3,21 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_rtc_time.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -28,6 +36,8 @@
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 
+#include "json_writer.h"
+
 static const char *TAG = "PRIAM";
 
 // Configurable entity names (stored in NVS)
@@ -68,6 +78,7 @@ static const ble_uuid128_t BATTERY_LED_CHAR_UUID =
 #define PRIAM_MANUFACTURER_ID 0x078D
 
 static uint16_t conn_handle = BLE_HS_CONN_HANDLE_NONE;
+static uint16_t conn_dead_handle = BLE_HS_CONN_HANDLE_NONE;  // Declared dead, terminate still pending
 static bool ble_connected = false;
 static ble_addr_t priam_addr;
 static bool priam_found = false;
@@ -76,10 +87,7 @@ static volatile int scan_device_count = 0;
 static volatile int scan_cycle_count = 0;
 static char last_found_name[32] = "";
 
-// Best candidate address (prefer random type=1 over public type=0)
-static ble_addr_t best_priam_addr;
-static bool have_candidate = false;
-static int64_t candidate_found_time = 0;
+static bool have_candidate = false;  // Candidate seen, settle timer running
 static volatile int last_connect_rc = -999;
 static volatile int last_connect_status = -999;
 static volatile int last_write_rc = -999;
@@ -89,66 +97,397 @@ static uint16_t status_val_handle = 0;
 static uint16_t drive_mode_val_handle = 0;
 static uint16_t rocking_val_handle = 0;
 static uint16_t battery_led_val_handle = 0;
+static uint16_t status_cccd_handle = 0;
+static uint16_t drive_mode_cccd_handle = 0;
+static uint16_t rocking_cccd_handle = 0;
+static uint16_t chr_end_handle[3];  // Last handle of STATUS, DRIVE_MODE, ROCKING (descriptors included)
 static uint16_t service_start_handle = 0;
 static uint16_t service_end_handle = 0;
 static bool service_found = false;
 static bool chars_discovered = false;
 
-static int battery_percent = -1;
-static int battery_leds = -1;
-static int drive_mode = -1;
-static bool is_rocking = false;
-static volatile int pending_mode = 0;
-static volatile int pending_rock_start = 0;
-static volatile int pending_rock_stop = 0;
-static volatile int rock_minutes = 5;      // 0 = continuous, 1-30 = timer
-static volatile int rock_intensity = 100;  // 0-100%
-
-// Auto-renew rocking mode
-static volatile bool auto_renew_enabled = false;
-static volatile int64_t rock_start_time = 0;
-static volatile int auto_renew_duration = 120;  // 2 hours default
-static volatile int auto_renew_threshold = 10; // Renew when 10 min left
+// Bridge state
+// What we know about the stroller and the rocking session, in one struct.
+// It is written by the host task, the command executor, httpd and MQTT, so
+// every write goes through state_begin()/state_end(): a short critical section
+// that admits one writer at a time and moves a seqlock sequence. Readers copy
+// the whole struct with state_get() and retry if a write overlapped, so they
+// never block and never mix fields of two sessions. version moves whenever a
+// write changed something.
+typedef struct {
+    uint32_t version;
+    int8_t battery;                 // %, -1 = unknown
+    int8_t battery_leds;            // -1 = unknown
+    int8_t drive_mode;              // 1..3, -1 = unknown
+    bool rocking;
+    uint8_t rock_minutes;           // Current device segment, 0 = continuous
+    uint8_t intensity;              // 0-100%
+    bool auto_renew;                // Keep chaining segments until stopped
+    bool session;                   // The session engine owns renewals
+    uint16_t auto_renew_duration;   // min, length of a session started over MQTT
+    int64_t rock_start_s;           // Boot-relative seconds the segment started, 0 = never
+    int64_t session_end_s;          // Session deadline, 0 = open-ended
+    int64_t time_left_us;           // When the stroller reported time_left_s, 0 = not this segment
+    int32_t time_left_s;            // Its countdown then; see Rocking sessions
+} bridge_state_t;
+
+static bridge_state_t state = {
+    .battery = -1, .battery_leds = -1, .drive_mode = -1,
+    .rock_minutes = 5, .intensity = 100, .auto_renew_duration = 120,
+};
+static bridge_state_t state_prev;       // Taken by state_begin() to spot changes
+static _Atomic uint32_t state_seq = 0;  // Odd while a write is in progress
+static portMUX_TYPE state_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void session_save(void);
+
+// Only plain field updates between begin and end: no logging, no blocking calls
+static bridge_state_t *state_begin(void) {
+    portENTER_CRITICAL(&state_mux);
+    memcpy(&state_prev, &state, sizeof(state));  // memcpy keeps padding comparable
+    atomic_store_explicit(&state_seq, state_seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return &state;
+}
+
+// True if the write changed anything
+static bool state_end(void) {
+    bool changed = memcmp(&state, &state_prev, sizeof(state)) != 0;
+    if (changed) state.version++;
+    atomic_store_explicit(&state_seq, state_seq + 1, memory_order_release);
+    portEXIT_CRITICAL(&state_mux);
+    if (changed) session_save();
+    return changed;
+}
+
+static void state_get(bridge_state_t *out) {
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&state_seq, memory_order_acquire);
+        memcpy(out, &state, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&state_seq, memory_order_relaxed));
+}
 
 // MQTT
+#define MQTT_AVAIL_TOPIC "epriam/availability"  // Retained; LWT sets "offline"
+#define MQTT_CLIENT_ID "epriam"                 // Fixed so a persistent session can be resumed
+#define MQTT_OUTBOX_LIMIT (8 * 1024)            // Bytes of unacked QoS 1 messages kept while offline
 static esp_mqtt_client_handle_t mqtt_client = NULL;
 static bool mqtt_connected = false;
+static volatile bool mqtt_shadow_stale = true;  // Broker may have lost state, republish everything
+static bool mqtt_json_state = false;            // One JSON document on MQTT_JSON_STATE_TOPIC (stored in NVS)
+static bool mqtt_device_discovery = false;      // Single device-based discovery payload (stored in NVS)
+static bool mqtt_persistent = false;            // Persistent session + QoS 1 commands (stored in NVS, applied at boot)
+static int64_t mqtt_connected_us = 0;
+static volatile int32_t mqtt_connect_to_state_ms = -1;
+
+// Event log
+// Fixed-size binary records in a ring, numbered by a sequence that never
+// repeats. Logging only copies a few words under the spinlock, so it is cheap
+// from BLE callbacks; the text is produced when a client reads the record
+// (ev_format). /api/log?since=<seq> and the SSE "log" event read from here.
+#define EVLOG_SLOTS 64     // Power of two
+#define EV_LINE_LEN 112
 
-// Web log buffer (circular)
-#define WEB_LOG_SIZE 2048
-static char web_log[WEB_LOG_SIZE];
-static int web_log_pos = 0;
+typedef enum {
+    EV_READY, EV_READY_BOOT, EV_LINK_DEAD, EV_WRITE_FAILED, EV_CMD_EXPIRED, EV_SETUP_FAILED,
+    EV_CACHE_STALE, EV_FOUND, EV_SEEN, EV_SEEN_MFG, EV_CONNECTING, EV_CONNECT_RC, EV_DIRECT,
+    EV_CONNECTED, EV_CONNECT_FAILED, EV_DISCONNECTED, EV_SCAN, EV_SCAN_FAILED, EV_MANUAL_SCAN,
+    EV_ROCK_RENEW, EV_ROCK_END, EV_SESSION_RESTORED, EV_SESSION_RESUMED, EV_OTA_START, EV_OTA_DONE, EV_COUNT
+} ev_id_t;
+
+// args has one letter per conversion in fmt: d = next integer argument,
+// s = the static string, a = the address, t = its type, n = its advertised name
+typedef struct {
+    const char *key;
+    const char *fmt;
+    const char *args;
+} ev_desc_t;
+
+static const ev_desc_t ev_descs[EV_COUNT] = {
+    [EV_READY] = {"ready", "Ready in %d ms (%s)", "ds"},
+    [EV_READY_BOOT] = {"ready_boot", "Ready %d ms after boot", "d"},
+    [EV_LINK_DEAD] = {"link_dead", "Link dead (%s) after %d ms", "sd"},
+    [EV_WRITE_FAILED] = {"write_failed", "Write #%u %s: %d", "dsd"},
+    [EV_CMD_EXPIRED] = {"cmd_expired", "Command #%u expired (BLE down)", "d"},
+    [EV_SETUP_FAILED] = {"setup_failed", "Setup %s failed: %d", "sd"},
+    [EV_CACHE_STALE] = {"cache_stale", "Handle cache stale, rediscovering", ""},
+    [EV_FOUND] = {"found", "*** FOUND: %s %d %s ***", "nda"},
+    [EV_SEEN] = {"seen", "%s %d %s", "nda"},
+    [EV_SEEN_MFG] = {"seen_mfg", "(no name) mfg=0x%04X %d %s", "dda"},
+    [EV_CONNECTING] = {"connecting", "Connecting to %s (type=%d)...", "at"},
+    [EV_CONNECT_RC] = {"connect_rc", "Connect failed: rc=%d", "d"},
+    [EV_DIRECT] = {"direct", "Direct connect to cached peer", ""},
+    [EV_CONNECTED] = {"connected", "*** CONNECTED ***", ""},
+    [EV_CONNECT_FAILED] = {"connect_failed", "Connection failed: %d", "d"},
+    [EV_DISCONNECTED] = {"disconnected", "Disconnected: 0x%04X", "d"},
+    [EV_SCAN] = {"scan", "Scan #%d started...", "d"},
+    [EV_SCAN_FAILED] = {"scan_failed", "Scan failed: %d", "d"},
+    [EV_MANUAL_SCAN] = {"manual_scan", "Manual scan started", ""},
+    [EV_ROCK_RENEW] = {"rock_renew", "Rocking renewed: %d min segment, %d s were left", "dd"},
+    [EV_ROCK_END] = {"rock_end", "Rocking session ended (%s)", "s"},
+    [EV_SESSION_RESTORED] = {"session_restored", "Session restored from %s: %d s left, %d ms since last save", "sdd"},
+    [EV_SESSION_RESUMED] = {"session_resumed", "Rocking resumed %d ms after boot", "d"},
+    [EV_OTA_START] = {"ota_start", "OTA: Starting, %d bytes", "d"},
+    [EV_OTA_DONE] = {"ota_done", "OTA: Success! Rebooting...", ""},
+};
+
+typedef struct {
+    uint32_t seq;
+    uint32_t ms;      // Since boot
+    uint8_t id;       // ev_id_t
+    ble_addr_t addr;
+    int32_t arg[2];
+    const char *str;  // Literal or other static string, never a buffer
+} ev_rec_t;
+
+static ev_rec_t ev_ring[EVLOG_SLOTS];
+static uint32_t ev_head = 1;  // Sequence of the next record; 0 is never used
 static portMUX_TYPE log_mux = portMUX_INITIALIZER_UNLOCKED;
 
-static void web_log_add(const char *fmt, ...) {
-    char buf[128];
-    va_list args;
-    va_start(args, fmt);
-    int len = vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
-    if (len > 0) {
-        portENTER_CRITICAL(&log_mux);
-        for (int i = 0; i < len && i < 127; i++) {
-            web_log[web_log_pos] = buf[i];
-            web_log_pos = (web_log_pos + 1) % WEB_LOG_SIZE;
+static void sse_notify(void);
+
+static void ev_log(ev_id_t id, const char *str, int32_t a0, int32_t a1, const ble_addr_t *addr) {
+    uint32_t ms = (uint32_t)(esp_timer_get_time() / 1000);
+    portENTER_CRITICAL(&log_mux);
+    ev_rec_t *e = &ev_ring[ev_head % EVLOG_SLOTS];
+    e->seq = ev_head++;
+    e->ms = ms;
+    e->id = id;
+    e->arg[0] = a0;
+    e->arg[1] = a1;
+    e->str = str;
+    if (addr) e->addr = *addr;
+    else memset(&e->addr, 0, sizeof(e->addr));
+    portEXIT_CRITICAL(&log_mux);
+    sse_notify();
+}
+
+// Copy record seq; false once it has been overwritten (or not written yet)
+static bool ev_read(uint32_t seq, ev_rec_t *out) {
+    portENTER_CRITICAL(&log_mux);
+    *out = ev_ring[seq % EVLOG_SLOTS];
+    portEXIT_CRITICAL(&log_mux);
+    return seq && out->seq == seq;
+}
+
+static uint32_t ev_next_seq(void) {
+    portENTER_CRITICAL(&log_mux);
+    uint32_t seq = ev_head;
+    portEXIT_CRITICAL(&log_mux);
+    return seq;
+}
+
+// Deferred logging
+// ESP_LOGx formats and writes to the console (USB-Serial-JTAG) on the calling
+// task. Hot paths, the NimBLE host task above all, use DLOGx() instead: it
+// stores the format pointer and up to DLOG_ARGS raw arguments in a lock-free
+// ring, and dlog_task formats and prints them at low priority. Each call site
+// has a minimum interval (0 = none); lines it suppressed are counted on its
+// next one. Levels are per subsystem and can be changed at runtime over
+// /api/loglevel or MQTT_LOG_LEVEL_TOPIC. Arguments are integers (at most
+// pointer-sized) or static strings wrapped in DLOG_STR(). Build with
+// -DDLOG_SYNC to print on the caller instead, e.g. to compare dlog_call_us.
+#define DLOG_SLOTS 32  // Power of two
+#define DLOG_ARGS 7
+#define DLOG_DRAIN_MS 50
+#define DLOG_LINE_LEN 160
+#ifdef DLOG_SYNC
+#define DLOG_DEFERRED false
+#else
+#define DLOG_DEFERRED true
+#endif
+
+typedef enum { LOG_BLE, LOG_SCAN, LOG_CMD, LOG_MQTT, LOG_SUB_COUNT } log_sub_t;
+static const char *const log_sub_names[LOG_SUB_COUNT] = { "ble", "scan", "cmd", "mqtt" };
+static const char *const log_level_names[] = { "none", "error", "warn", "info", "debug", "verbose" };
+static volatile uint8_t log_levels[LOG_SUB_COUNT] = { ESP_LOG_INFO, ESP_LOG_INFO, ESP_LOG_INFO, ESP_LOG_INFO };
+
+typedef struct {
+    uint32_t min_ms;
+    uint32_t last_ms;
+    uint32_t suppressed;
+} dlog_site_t;
+
+typedef struct {
+    _Atomic uint32_t seq;  // pos + 1 once written, pos + DLOG_SLOTS once free again
+    const char *fmt;
+    uint8_t level;
+    uint8_t sub;
+    uint32_t ms;
+    uint32_t suppressed;
+    uintptr_t arg[DLOG_ARGS];
+} dlog_cell_t;
+
+static dlog_cell_t dlog_ring[DLOG_SLOTS];
+static _Atomic uint32_t dlog_head = 0;  // Next position to claim (any task)
+static uint32_t dlog_tail = 0;          // Next position to print (dlog_task)
+static TaskHandle_t dlog_handle = NULL;
+static volatile uint32_t dlog_dropped = 0;
+static volatile uint32_t dlog_suppressed = 0;
+static volatile uint32_t dlog_calls = 0;
+static volatile uint32_t dlog_call_us = 0;  // Time callers spent in dlog_put()
+
+#define DLOG_STR(s) ((uintptr_t)(const char *)(s))
+#define DLOG(sub, level, min_ms, fmt, ...) do { \
+        static dlog_site_t dlog_site_ = {(min_ms), 0, 0}; \
+        if ((level) <= log_levels[sub]) \
+            dlog_put(&dlog_site_, (sub), (level), (fmt), (const uintptr_t[DLOG_ARGS]){__VA_ARGS__}); \
+    } while (0)
+#define DLOGE(sub, min_ms, fmt, ...) DLOG(sub, ESP_LOG_ERROR, min_ms, fmt, ##__VA_ARGS__)
+#define DLOGW(sub, min_ms, fmt, ...) DLOG(sub, ESP_LOG_WARN, min_ms, fmt, ##__VA_ARGS__)
+#define DLOGI(sub, min_ms, fmt, ...) DLOG(sub, ESP_LOG_INFO, min_ms, fmt, ##__VA_ARGS__)
+#define DLOGD(sub, min_ms, fmt, ...) DLOG(sub, ESP_LOG_DEBUG, min_ms, fmt, ##__VA_ARGS__)
+
+// Parse the conversion at *f ("%04X", "%lu", ...) into spec; returns its letter
+static char fmt_spec(const char **f, char spec[8]) {
+    const char *p = *f + 1;
+    while (*p && !strchr("diouxXcs%", *p) && p - *f < 6) p++;
+    char conv = *p;
+    int n = p - *f + (conv ? 1 : 0);
+    memcpy(spec, *f, n);
+    spec[n] = 0;
+    *f += n;
+    return conv;
+}
+
+static int dlog_format(char *out, int len, const char *f, const uintptr_t *arg) {
+    int n = 0, ai = 0;
+    while (*f && n < len - 1) {
+        if (*f != '%') {
+            out[n++] = *f++;
+            continue;
+        }
+        char spec[8];
+        char conv = fmt_spec(&f, spec);
+        if (conv == '%') {
+            out[n++] = '%';
+            continue;
         }
-        web_log[web_log_pos] = '\n';
-        web_log_pos = (web_log_pos + 1) % WEB_LOG_SIZE;
-        portEXIT_CRITICAL(&log_mux);
+        uintptr_t a = ai < DLOG_ARGS ? arg[ai++] : 0;
+        bool sgn = conv == 'd' || conv == 'i';
+        int m;
+        if (conv == 's') m = snprintf(out + n, len - n, spec, a ? (const char *)a : "?");
+        else if (strchr(spec, 'l')) m = sgn ? snprintf(out + n, len - n, spec, (long)(intptr_t)a) : snprintf(out + n, len - n, spec, (unsigned long)a);
+        else m = sgn ? snprintf(out + n, len - n, spec, (int)(intptr_t)a) : snprintf(out + n, len - n, spec, (unsigned)a);
+        if (m > 0) n += m;
     }
+    if (n > len - 1) n = len - 1;
+    out[n] = 0;
+    return n;
+}
+
+static void dlog_emit(uint8_t level, uint8_t sub, uint32_t ms, uint32_t suppressed, const char *line) {
+    char more[28] = "";
+    if (suppressed) snprintf(more, sizeof(more), " (+%lu suppressed)", (unsigned long)suppressed);
+    ESP_LOG_LEVEL((esp_log_level_t)level, TAG, "[%s @%lu] %s%s", log_sub_names[sub], (unsigned long)ms, line, more);
+}
+
+static void dlog_put(dlog_site_t *site, log_sub_t sub, esp_log_level_t level, const char *fmt, const uintptr_t *arg) {
+    int64_t t0 = esp_timer_get_time();
+    uint32_t ms = (uint32_t)(t0 / 1000);
+    if (site->min_ms && site->last_ms && ms - site->last_ms < site->min_ms) {
+        site->suppressed++;
+        dlog_suppressed++;
+        return;
+    }
+    site->last_ms = ms ? ms : 1;
+#ifdef DLOG_SYNC
+    char line[DLOG_LINE_LEN];
+    dlog_format(line, sizeof(line), fmt, arg);
+    dlog_emit(level, sub, ms, site->suppressed, line);
+#else
+    // Bounded MPSC ring: claim a position with a CAS, publish it through seq
+    uint32_t pos = atomic_load_explicit(&dlog_head, memory_order_relaxed);
+    dlog_cell_t *c;
+    for (;;) {
+        c = &dlog_ring[pos % DLOG_SLOTS];
+        int32_t dif = (int32_t)(atomic_load_explicit(&c->seq, memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dlog_head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            dlog_dropped++;  // Full; the site's suppressed count carries over
+            return;
+        } else {
+            pos = atomic_load_explicit(&dlog_head, memory_order_relaxed);
+        }
+    }
+    c->fmt = fmt;
+    c->level = level;
+    c->sub = sub;
+    c->ms = ms;
+    c->suppressed = site->suppressed;
+    memcpy(c->arg, arg, sizeof(c->arg));
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    if (dlog_handle) xTaskNotifyGive(dlog_handle);
+#endif
+    site->suppressed = 0;
+    dlog_calls++;
+    dlog_call_us += (uint32_t)(esp_timer_get_time() - t0);
+}
+
+// Sleeps until dlog_put() wakes it, then lets the burst collect for
+// DLOG_DRAIN_MS and prints everything queued
+static void dlog_task(void *arg) {
+    char line[DLOG_LINE_LEN];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_MS));
+        while (1) {
+            dlog_cell_t *c = &dlog_ring[dlog_tail % DLOG_SLOTS];
+            if (atomic_load_explicit(&c->seq, memory_order_acquire) != dlog_tail + 1) break;
+            dlog_format(line, sizeof(line), c->fmt, c->arg);
+            uint8_t level = c->level, sub = c->sub;
+            uint32_t ms = c->ms, suppressed = c->suppressed;
+            atomic_store_explicit(&c->seq, dlog_tail + DLOG_SLOTS, memory_order_release);
+            dlog_tail++;
+            dlog_emit(level, sub, ms, suppressed, line);
+        }
+    }
+}
+
+static void dlog_init(void) {
+    for (int i = 0; i < DLOG_SLOTS; i++) atomic_init(&dlog_ring[i].seq, i);
+#ifndef DLOG_SYNC
+    xTaskCreate(dlog_task, "dlog", 3072, NULL, 1, &dlog_handle);
+#endif
+}
+
+// Set one subsystem (or every one, sub = NULL) to a level name; false if unknown
+static bool log_level_set(const char *sub, const char *level) {
+    int lv = -1;
+    for (int i = 0; i < (int)(sizeof(log_level_names) / sizeof(log_level_names[0])); i++) {
+        if (strcmp(level, log_level_names[i]) == 0) lv = i;
+    }
+    if (lv < 0) return false;
+    bool hit = false;
+    int max = ESP_LOG_INFO;
+    for (int i = 0; i < LOG_SUB_COUNT; i++) {
+        if (!sub || strcmp(sub, log_sub_names[i]) == 0) {
+            log_levels[i] = lv;
+            hit = true;
+        }
+        if (log_levels[i] > max) max = log_levels[i];
+    }
+    esp_log_level_set(TAG, (esp_log_level_t)max);  // Let debug lines through the console filter
+    return hit;
 }
 
 static EventGroupHandle_t s_wifi_event_group;
+static char ip_str[16] = "";
 #define WIFI_CONNECTED_BIT BIT0
 static httpd_handle_t server = NULL;
 
 static void ble_app_scan(void);
+static bool scan_window_start(void);
 static int ble_gap_event(struct ble_gap_event *event, void *arg);
-static void read_all_characteristics(void);
-static void process_pending_commands(void);
+static void ble_cmd_kick(void);
 static void mqtt_publish_state(void);
-static void mqtt_publish_discovery(void);
-static void auto_renew_task(void *arg);
+static void mqtt_publish_discovery(bool force);
+static void rock_session_notify(bool rocking, int time_left);
+static void session_acked(uint32_t id);
 static void load_entity_names(void);
 static void save_entity_names(void);
 
@@ -160,6 +499,8 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        snprintf(ip_str, sizeof(ip_str), IPSTR, IP2STR(&event->ip_info.ip));
+        mqtt_publish_state();
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
@@ -179,215 +520,1054 @@ static void wifi_init(void) {
     ESP_ERROR_CHECK(esp_wifi_start());
 }
 
-static bool is_priam_device(const struct ble_gap_disc_desc *disc) {
-    struct ble_hs_adv_fields fields;
+static bool name_is_priam(const char *name) {
+    return strstr(name, "PRIAM") || strstr(name, "priam") ||
+           strstr(name, "RN4871") || strstr(name, "RN487") ||
+           strstr(name, "Cybex") || strstr(name, "CYBEX");
+}
+
+// Scan policy
+// OPEN is the old behaviour (active, every advert fully parsed) and is kept for
+// debugging. FILTERED scans passively with controller duplicate filtering and
+// only does string work on adverts that carry a name. A cycle is run as
+// SCAN_DUP_RESET_MS windows: each restart clears the duplicate filter, so the
+// seen table gets one RSSI sample per device per window. The first window is
+// active, a short burst for strollers whose name is only in the scan response.
+// WL additionally lets the controller drop everything but the cached peer on
+// every other cycle; those cycles scan actively, since only the peer answers.
+typedef enum { SCAN_MODE_OPEN, SCAN_MODE_FILTERED, SCAN_MODE_WL } scan_mode_t;
+
+static const char *const scan_mode_names[] = { "open", "filtered", "wl" };
+
+static volatile scan_mode_t scan_mode = SCAN_MODE_FILTERED;
+static scan_mode_t scan_cur_mode = SCAN_MODE_FILTERED;  // Mode of the scan in progress
+static bool scan_cur_wl = false;
+static volatile int scan_itvl_ms = 100;
+static volatile int scan_window_ms = 50;    // window/itvl leaves the shared radio to Wi-Fi
+static volatile int scan_duration_ms = 10000;
+static volatile int scan_idle_ms = 5000;    // Pause between scan cycles
+#define SCAN_DUP_RESET_MS 1000                // Window length between duplicate filter restarts
+static int64_t scan_cycle_us = 0;            // When the cycle in progress started
+static int scan_window_no = 0;               // Windows started in the cycle in progress
+static volatile uint32_t scan_adv_rx = 0;
+static volatile uint32_t scan_adv_parsed = 0;
+
+// Walk the raw AD structures for the manufacturer ID and local name. Runs for
+// every advert, so no ble_hs_adv_parse_fields and no formatting.
+static void adv_peek(const uint8_t *d, uint8_t len, int *mfg_id, const uint8_t **name, uint8_t *name_len) {
+    *mfg_id = -1;
+    *name = NULL;
+    *name_len = 0;
+    for (int i = 0; i + 1 < len; ) {
+        uint8_t l = d[i];
+        if (l == 0 || i + 1 + l > len) break;
+        uint8_t type = d[i + 1];
+        if (type == 0xFF && l >= 3) {
+            *mfg_id = d[i + 2] | (d[i + 3] << 8);
+        } else if (type == 0x08 || type == 0x09) {  // Shortened / complete local name
+            *name = &d[i + 2];
+            *name_len = l - 1;
+        }
+        i += 1 + l;
+    }
+}
+
+// What the scanner learned from one advert
+typedef struct {
+    int mfg_id;  // -1 = none
+    char name[20];
+} adv_info_t;
+
+static bool is_priam_device(const struct ble_gap_disc_desc *disc, adv_info_t *info) {
     scan_device_count++;
+    scan_adv_rx++;
+    info->mfg_id = -1;
+    info->name[0] = 0;
     
-    char addr_str[18];
-    snprintf(addr_str, sizeof(addr_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-        disc->addr.val[5], disc->addr.val[4], disc->addr.val[3],
-        disc->addr.val[2], disc->addr.val[1], disc->addr.val[0]);
+    const uint8_t *nm = NULL;
+    uint8_t nl = 0;
+    if (scan_cur_mode != SCAN_MODE_OPEN) {
+        adv_peek(disc->data, disc->length_data, &info->mfg_id, &nm, &nl);
+        if (scan_cur_wl) return true;  // Controller only reports the cached peer
+        if (info->mfg_id == MICROCHIP_MANUFACTURER_ID || info->mfg_id == PRIAM_MANUFACTURER_ID) return true;
+        if (!nm) return false;
+    } else {
+        struct ble_hs_adv_fields fields;
+        if (ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data) != 0) return false;
+        if (fields.mfg_data_len >= 2) info->mfg_id = fields.mfg_data[0] | (fields.mfg_data[1] << 8);
+        nm = fields.name;
+        nl = fields.name_len;
+    }
+    scan_adv_parsed++;
     
-    if (ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data) == 0) {
-        // Check name first - more reliable
-        if (fields.name && fields.name_len > 0) {
-            char name[32];
-            int len = fields.name_len < 31 ? fields.name_len : 31;
-            memcpy(name, fields.name, len);
-            name[len] = 0;
-            
-            // Log all named devices for debugging
-            ESP_LOGI(TAG, "Device: %s (type=%d)", name, disc->addr.type);
-            web_log_add("%s %d %s", name, disc->rssi, addr_str);
-            
-            if (strstr(name, "PRIAM") || strstr(name, "priam") || 
-                strstr(name, "RN4871") || strstr(name, "RN487") ||
-                strstr(name, "Cybex") || strstr(name, "CYBEX")) {
-                strncpy(last_found_name, name, 31);
-                last_found_name[31] = 0;
-                ESP_LOGI(TAG, "*** E-Priam: %s ***", name);
-                web_log_add("*** FOUND: %s ***", name);
-                return true;
-            }
-        } else {
-            // Log unnamed devices with manufacturer data
-            if (fields.mfg_data_len >= 2) {
-                uint16_t mfg_id = fields.mfg_data[0] | (fields.mfg_data[1] << 8);
-                web_log_add("(no name) mfg=0x%04X %d %s", mfg_id, disc->rssi, addr_str);
-            }
-        }
-        
-        // Check manufacturer ID as backup
-        if (fields.mfg_data_len >= 2) {
-            uint16_t mfg_id = fields.mfg_data[0] | (fields.mfg_data[1] << 8);
-            if (mfg_id == MICROCHIP_MANUFACTURER_ID || mfg_id == PRIAM_MANUFACTURER_ID) {
-                ESP_LOGI(TAG, "*** E-Priam by mfg: 0x%04X ***", mfg_id);
-                web_log_add("*** FOUND mfg: 0x%04X ***", mfg_id);
-                return true;
-            }
-        }
+    if (nm && nl > 0) {
+        int n = nl < (int)sizeof(info->name) - 1 ? nl : (int)sizeof(info->name) - 1;
+        memcpy(info->name, nm, n);
+        info->name[n] = 0;
+        if (name_is_priam(info->name)) return true;
     }
-    return false;
+    // Manufacturer ID as backup
+    return info->mfg_id == MICROCHIP_MANUFACTURER_ID || info->mfg_id == PRIAM_MANUFACTURER_ID;
 }
 
-static int on_status_read(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
-    if (e->status == 0 && a) {
-        uint8_t d[20];
-        uint16_t l = OS_MBUF_PKTLEN(a->om);
-        if (l > 20) l = 20;
-        os_mbuf_copydata(a->om, 0, l, d);
-        
-        // Log all bytes for analysis
-        ESP_LOGI(TAG, "STATUS raw len=%d: [%02X %02X %02X %02X %02X %02X %02X %02X]", 
-            l, d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
-        
-        if (l >= 4) {
-            // Battery calculation from python-priam:
-            // voltage = d[3] * 2 (in decivolts, e.g. 350 = 35.0V)
-            // percentage = (voltage - 315) / (380 - 315) * 100
-            int voltage = (d[3] & 0xFF) * 2;
-            int pct = ((voltage - 315) * 100) / 65;  // 65 = 380 - 315
-            if (pct < 0) pct = 0;
-            if (pct > 100) pct = 100;
-            battery_percent = pct;
-            ESP_LOGI(TAG, "Batt: %d%% (voltage=%d)", battery_percent, voltage);
-            mqtt_publish_state();  // Update HA when battery changes
+// Connection state machine
+// Runs entirely on the NimBLE host task: GAP events drive the transitions and
+// retries are scheduled on a callout, so the host task never sleeps.
+typedef enum {
+    CONN_IDLE,
+    CONN_SCANNING,
+    CONN_CONNECTING,
+    CONN_DISCOVERING,
+    CONN_READY,
+    CONN_BACKOFF,
+} conn_state_t;
+
+static const char *const conn_state_names[] = {
+    "IDLE", "SCANNING", "CONNECTING", "DISCOVERING", "READY", "BACKOFF"
+};
+
+#define BACKOFF_MAX_MS 30000        // Cap for ordinary failures
+#define BACKOFF_STUCK_MAX_MS 60000  // Cap for 0x3E (stroller BLE stuck)
+#define BACKOFF_MAX_SHIFT 6
+
+static volatile conn_state_t conn_state = CONN_IDLE;
+static volatile int64_t conn_state_since = 0;  // us
+static volatile int conn_attempt = 0;
+static volatile uint32_t conn_backoff_ms = 0;
+static volatile int conn_last_reason = 0;
+static volatile int64_t conn_boot_to_ready_ms = -1;
+static int64_t conn_connected_us = 0;
+static volatile int32_t conn_to_ready_ms = -1;
+static bool conn_via_cache = false;    // Current attempt is a direct connect to the cached peer
+static bool conn_cache_tried = false;  // Direct connect already tried since the last READY
+static bool handles_from_cache = false;
+static struct ble_npl_callout conn_timer;
+
+static void conn_start(void);
+static void conn_teardown(void);
+
+static void conn_set_state(conn_state_t st) {
+    if (st == conn_state) return;
+    DLOGI(LOG_BLE, 0, "Conn: %s -> %s", DLOG_STR(conn_state_names[conn_state]), DLOG_STR(conn_state_names[st]));
+    conn_state = st;
+    conn_state_since = esp_timer_get_time();
+    if (st == CONN_READY) {
+        conn_attempt = 0;
+        conn_cache_tried = false;
+        conn_to_ready_ms = (int32_t)((conn_state_since - conn_connected_us) / 1000);
+        DLOGI(LOG_BLE, 0, "Ready %d ms after CONNECT (%s)", conn_to_ready_ms,
+            DLOG_STR(handles_from_cache ? "cached handles" : "full discovery"));
+        ev_log(EV_READY, handles_from_cache ? "cache" : "discovery", conn_to_ready_ms, 0, NULL);
+        if (conn_boot_to_ready_ms < 0) {
+            conn_boot_to_ready_ms = conn_state_since / 1000;
+            ev_log(EV_READY_BOOT, NULL, conn_boot_to_ready_ms, 0, NULL);
         }
     }
+}
+
+static uint32_t conn_state_ms(void) {
+    return (uint32_t)((esp_timer_get_time() - conn_state_since) / 1000);
+}
+
+// Exponential backoff with +/-25% jitter; base and cap depend on why we lost the link
+static uint32_t conn_backoff_for(int reason) {
+    // HCI reason codes arrive as BLE_HS_ERR_HCI_BASE + code
+    int hci = (reason >= BLE_HS_ERR_HCI_BASE && reason < BLE_HS_ERR_HCI_BASE + 0x100)
+        ? reason - BLE_HS_ERR_HCI_BASE : -1;
+    uint32_t base, cap;
+    switch (hci) {
+        case BLE_ERR_REM_USER_CONN_TERM:
+        case BLE_ERR_CONN_TERM_LOCAL:
+            // Clean disconnect, the stroller is still in range
+            base = 250; cap = 5000;
+            break;
+        case BLE_ERR_CONN_SPVN_TMO:
+            // Out of range or powered off
+            base = 1000; cap = BACKOFF_MAX_MS;
+            break;
+        case BLE_ERR_CONN_ESTABLISHMENT:
+            // 0x3E: RN4871 is wedged (see README), retrying fast only keeps it busy
+            base = 3000; cap = BACKOFF_STUCK_MAX_MS;
+            break;
+        default:
+            base = 500; cap = BACKOFF_MAX_MS;
+            break;
+    }
+    int shift = conn_attempt < BACKOFF_MAX_SHIFT ? conn_attempt : BACKOFF_MAX_SHIFT;
+    uint32_t d = base << shift;
+    if (d > cap) d = cap;
+    return d - d / 4 + esp_random() % (d / 2 + 1);
+}
+
+static void conn_schedule(int reason, uint32_t delay_ms) {
+    conn_last_reason = reason;
+    conn_backoff_ms = delay_ms;
+    conn_set_state(CONN_BACKOFF);
+    ble_npl_callout_reset(&conn_timer, ble_npl_time_ms_to_ticks32(delay_ms));
+}
+
+static void conn_schedule_retry(int reason) {
+    uint32_t d = conn_backoff_for(reason);
+    conn_attempt++;
+    DLOGI(LOG_BLE, 0, "Retry #%d in %lu ms (reason=0x%04X)", conn_attempt, d, reason);
+    conn_schedule(reason, d);
+}
+
+static void conn_timer_cb(struct ble_npl_event *ev) {
+    switch (conn_state) {
+        case CONN_SCANNING:
+            ble_gap_disc_cancel();  // Manual rescan restarts the scan window
+            ble_app_scan();
+            break;
+        case CONN_IDLE:
+        case CONN_BACKOFF:
+            conn_start();
+            break;
+        default:
+            break;
+    }
+}
+
+// Safe from any task: skip the remaining backoff and scan now
+static void conn_rescan_now(void) {
+    conn_attempt = 0;
+    ble_npl_callout_reset(&conn_timer, 0);
+}
+
+// Connection-parameter policy
+// FAST (short interval, no latency) while commands are in flight or setup is
+// running, IDLE (long interval with peripheral latency) once we are only
+// watching notifications. The switch back to IDLE waits CONNPARAM_IDLE_HOLD_MS
+// after the last command so a burst of commands stays on the fast link.
+typedef enum { CONNPARAM_FAST, CONNPARAM_IDLE, CONNPARAM_COUNT } connparam_profile_t;
+
+static const char *const connparam_names[] = { "fast", "idle" };
+
+typedef struct {
+    uint16_t itvl_min, itvl_max;  // 1.25 ms units
+    uint16_t latency;             // Connection events the peripheral may skip
+    uint16_t timeout;             // 10 ms units
+} connparam_t;
+
+static connparam_t connparam_profiles[CONNPARAM_COUNT] = {
+    [CONNPARAM_FAST] = { .itvl_min = 6, .itvl_max = 24, .latency = 0, .timeout = 400 },    // 7.5-30 ms, 4 s
+    [CONNPARAM_IDLE] = { .itvl_min = 80, .itvl_max = 160, .latency = 4, .timeout = 600 },  // 100-200 ms, 6 s
+};
+
+static volatile uint32_t connparam_idle_hold_ms = 3000;
+static volatile int connparam_requested = -1;  // Profile last asked for, -1 = none
+static volatile uint16_t conn_itvl = 0;        // Negotiated values, controller units
+static volatile uint16_t conn_latency = 0;
+static volatile uint16_t conn_timeout = 0;
+static volatile int connparam_updates = 0;
+static volatile int connparam_rejects = 0;
+static volatile uint32_t cmd_rtt_ms = 0;                    // Last write-to-ack time
+static volatile uint32_t cmd_rtt_avg_ms[CONNPARAM_COUNT];  // Moving average per negotiated profile
+static struct ble_npl_callout connparam_timer;
+
+// Safe from any task
+static void connparam_request(connparam_profile_t p) {
+    if (!ble_connected || connparam_requested == (int)p) return;
+    const connparam_t *c = &connparam_profiles[p];
+    struct ble_gap_upd_params up = {
+        .itvl_min = c->itvl_min, .itvl_max = c->itvl_max,
+        .latency = c->latency, .supervision_timeout = c->timeout,
+        .min_ce_len = 0, .max_ce_len = 0,
+    };
+    int rc = ble_gap_update_params(conn_handle, &up);
+    if (rc == 0) {
+        connparam_requested = p;
+        DLOGI(LOG_BLE, 0, "Conn params -> %s", DLOG_STR(connparam_names[p]));
+    } else {
+        DLOGW(LOG_BLE, 0, "Conn param update (%s) failed: %d", DLOG_STR(connparam_names[p]), rc);
+    }
+}
+
+// Back to IDLE once nothing has been sent for the hold time
+static void connparam_idle_later(void) {
+    ble_npl_callout_reset(&connparam_timer, ble_npl_time_ms_to_ticks32(connparam_idle_hold_ms));
+}
+
+static void connparam_timer_cb(struct ble_npl_event *ev) {
+    if (conn_state == CONN_READY) connparam_request(CONNPARAM_IDLE);
+}
+
+// Read back what the controller actually agreed to
+static void connparam_refresh(void) {
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(conn_handle, &desc) == 0) {
+        conn_itvl = desc.conn_itvl;
+        conn_latency = desc.conn_latency;
+        conn_timeout = desc.supervision_timeout;
+        DLOGI(LOG_BLE, 0, "Conn params: itvl=%d us, latency=%d, timeout=%d ms",
+            conn_itvl * 1250, conn_latency, conn_timeout * 10);
+    }
+}
+
+// Which profile the negotiated interval falls into
+static connparam_profile_t connparam_current(void) {
+    return conn_itvl <= connparam_profiles[CONNPARAM_FAST].itvl_max ? CONNPARAM_FAST : CONNPARAM_IDLE;
+}
+
+static void connparam_record_rtt(uint32_t ms) {
+    cmd_rtt_ms = ms;
+    connparam_profile_t p = connparam_current();
+    cmd_rtt_avg_ms[p] = cmd_rtt_avg_ms[p] ? (cmd_rtt_avg_ms[p] * 3 + ms) / 4 : ms;
+}
+
+// Link-health supervisor
+// Runs once a second on the host task while READY. Any traffic from the
+// stroller counts as a sign of life; when notifications stop, a STATUS read
+// probes the link, and if that gets no answer the link is declared dead and
+// torn down instead of waiting out the supervision timeout.
+#define LINK_TICK_MS 1000
+#define LINK_PROBE_AFTER_MS 3000   // STATUS notifies ~1/s
+#define LINK_DEAD_MS 5000          // Silence (probe included) before giving up
+
+static volatile int64_t link_last_rx_us = 0;
+static volatile int8_t link_rssi = 0;
+static volatile int link_quality = -1;        // 0-100, -1 = no link
+static volatile bool link_probe_pending = false;
+static volatile int link_probes = 0;
+static volatile int link_dead_count = 0;
+static volatile int32_t link_detect_ms = -1;  // Last sign of life -> link declared dead
+static volatile int link_quality_published = -1;  // What MQTT and /api/status show, moves in steps >= 10
+static struct ble_npl_callout link_timer;
+
+static void link_alive(void) {
+    link_last_rx_us = esp_timer_get_time();
+}
+
+static uint32_t link_silence_ms(void) {
+    return (uint32_t)((esp_timer_get_time() - link_last_rx_us) / 1000);
+}
+
+// RSSI -90..-50 dBm maps to 0..100, halved while silent, quartered while a probe is out
+static int link_score(void) {
+    int q = (link_rssi + 90) * 100 / 40;
+    if (q < 0) q = 0;
+    if (q > 100) q = 100;
+    if (link_probe_pending) q /= 4;
+    else if (link_silence_ms() > LINK_PROBE_AFTER_MS) q /= 2;
+    return q;
+}
+
+static void link_start(void) {
+    link_alive();
+    link_probe_pending = false;
+    ble_npl_callout_reset(&link_timer, ble_npl_time_ms_to_ticks32(LINK_TICK_MS));
+}
+
+static void link_stop(void) {
+    ble_npl_callout_stop(&link_timer);
+    link_probe_pending = false;
+    link_quality = -1;
+    link_quality_published = -1;
+}
+
+static void link_declare_dead(const char *why) {
+    link_detect_ms = (int32_t)link_silence_ms();
+    link_dead_count++;
+    ESP_LOGW(TAG, "Link dead (%s), %d ms after last rx", why, (int)link_detect_ms);
+    ev_log(EV_LINK_DEAD, why, link_detect_ms, 0, NULL);
+    // Report the link down now. The host keeps the connection to that address
+    // until the terminate completes (up to the supervision timeout), and
+    // connecting to it before then fails with BLE_HS_EDONE, so the reconnect
+    // waits for that DISCONNECT; the timer only covers one that never comes.
+    uint16_t h = conn_handle;
+    uint32_t fallback_ms = MAX(conn_timeout * 10, LINK_DEAD_MS) + LINK_TICK_MS;
+    int rc = ble_gap_terminate(h, BLE_ERR_REM_USER_CONN_TERM);
+    conn_teardown();
+    conn_attempt = 0;
+    if (rc == 0) conn_dead_handle = h;
+    conn_schedule(BLE_HS_ERR_HCI_BASE + BLE_ERR_CONN_SPVN_TMO, rc == 0 ? fallback_ms : 0);
+}
+
+static int on_link_probe(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
+    if (!link_probe_pending) return 0;
+    link_probe_pending = false;
+    if (e->status == 0) link_alive();
+    else if (conn_state == CONN_READY) link_declare_dead("probe failed");
     return 0;
 }
 
+static void link_timer_cb(struct ble_npl_event *ev) {
+    if (conn_state != CONN_READY) return;
+    int8_t rssi;
+    if (ble_gap_conn_rssi(conn_handle, &rssi) == 0) link_rssi = rssi;
+    uint32_t silent = link_silence_ms();
+    if (silent > LINK_DEAD_MS) {
+        link_declare_dead(link_probe_pending ? "probe timeout" : "silent");
+        return;
+    }
+    if (silent > LINK_PROBE_AFTER_MS && !link_probe_pending && status_val_handle) {
+        link_probes++;
+        link_probe_pending = ble_gattc_read(conn_handle, status_val_handle, on_link_probe, NULL) == 0;
+    }
+    link_quality = link_score();
+    int d = link_quality - link_quality_published;
+    if (link_quality_published < 0 || d >= 10 || d <= -10) {
+        link_quality_published = link_quality;
+        mqtt_publish_state();
+    }
+    ble_npl_callout_reset(&link_timer, ble_npl_time_ms_to_ticks32(LINK_TICK_MS));
+}
+
+// Last-peer and GATT handle cache (NVS)
+// Lets a reconnect skip both the scan and service discovery: connect straight to
+// the last good address and check the cached handles with a single read.
+#define PEER_CACHE_VERSION 2
+#define CACHED_CONNECT_TIMEOUT_MS 4000
+
+typedef struct {
+    uint8_t version;
+    ble_addr_t addr;
+    uint16_t svc_start, svc_end;
+    uint16_t status, mode, rock, led;
+    uint16_t status_cccd, mode_cccd, rock_cccd;
+    uint32_t fingerprint;  // Service UUID + handle layout
+} peer_cache_t;
+
+static peer_cache_t peer_cache;
+static bool peer_cache_valid = false;
+static portMUX_TYPE peer_cache_mux = portMUX_INITIALIZER_UNLOCKED;  // peer_cache vs peer_cache_write()
+static esp_timer_handle_t peer_cache_timer = NULL;
+static volatile int peer_cache_hits = 0;
+static volatile int peer_cache_misses = 0;
+
+#define FNV1A_INIT 2166136261u
+
+static uint32_t fnv1a(const void *data, size_t len, uint32_t h) {
+    const uint8_t *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t peer_cache_fingerprint(const peer_cache_t *c) {
+    uint16_t layout[9] = {c->svc_start, c->svc_end, c->status, c->mode, c->rock, c->led,
+                          c->status_cccd, c->mode_cccd, c->rock_cccd};
+    uint32_t h = fnv1a(PRIAM_SERVICE_UUID.value, sizeof(PRIAM_SERVICE_UUID.value), FNV1A_INIT);
+    h = fnv1a(&c->addr, sizeof(c->addr), h);
+    return fnv1a(layout, sizeof(layout), h);
+}
+
+// esp_timer task: keeps the flash write off the host task
+static void peer_cache_write(void *arg) {
+    peer_cache_t c;
+    portENTER_CRITICAL(&peer_cache_mux);
+    c = peer_cache;
+    portEXIT_CRITICAL(&peer_cache_mux);
+    nvs_handle_t nvs;
+    if (nvs_open("epriam", NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_blob(nvs, "peer", &c, sizeof(c));
+        nvs_commit(nvs);
+        nvs_close(nvs);
+        ESP_LOGI(TAG, "Saved peer/handle cache to NVS");
+    }
+}
+
+static void load_peer_cache(void) {
+    const esp_timer_create_args_t args = {.callback = peer_cache_write, .name = "peer_cache"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &peer_cache_timer));
+    nvs_handle_t nvs;
+    if (nvs_open("epriam", NVS_READONLY, &nvs) == ESP_OK) {
+        size_t len = sizeof(peer_cache);
+        if (nvs_get_blob(nvs, "peer", &peer_cache, &len) == ESP_OK && len == sizeof(peer_cache) &&
+            peer_cache.version == PEER_CACHE_VERSION &&
+            peer_cache.fingerprint == peer_cache_fingerprint(&peer_cache)) {
+            peer_cache_valid = true;
+            ESP_LOGI(TAG, "Cached peer %02X:%02X:%02X:%02X:%02X:%02X (type=%d)",
+                peer_cache.addr.val[5], peer_cache.addr.val[4], peer_cache.addr.val[3],
+                peer_cache.addr.val[2], peer_cache.addr.val[1], peer_cache.addr.val[0], peer_cache.addr.type);
+        }
+        nvs_close(nvs);
+    }
+}
+
+// Store the current peer and handles (host task); the flash write is left to
+// peer_cache_timer and skipped if nothing changed
+static void save_peer_cache(void) {
+    peer_cache_t c = {
+        .version = PEER_CACHE_VERSION,
+        .addr = priam_addr,
+        .svc_start = service_start_handle, .svc_end = service_end_handle,
+        .status = status_val_handle, .mode = drive_mode_val_handle,
+        .rock = rocking_val_handle, .led = battery_led_val_handle,
+        .status_cccd = status_cccd_handle, .mode_cccd = drive_mode_cccd_handle,
+        .rock_cccd = rocking_cccd_handle,
+    };
+    c.fingerprint = peer_cache_fingerprint(&c);
+    if (peer_cache_valid && c.fingerprint == peer_cache.fingerprint) return;
+    portENTER_CRITICAL(&peer_cache_mux);
+    peer_cache = c;
+    portEXIT_CRITICAL(&peer_cache_mux);
+    peer_cache_valid = true;
+    esp_timer_stop(peer_cache_timer);
+    esp_timer_start_once(peer_cache_timer, 0);
+}
+
+// Battery calculation from python-priam:
+// voltage = d[3] * 2 (in decivolts, e.g. 350 = 35.0V)
+// percentage = (voltage - 315) / (380 - 315) * 100
+static int status_battery_pct(const uint8_t *d) {
+    int voltage = d[3] * 2;
+    int pct = ((voltage - 315) * 100) / 65;  // 65 = 380 - 315
+    if (pct < 0) pct = 0;
+    if (pct > 100) pct = 100;
+    return pct;
+}
+
 static int on_drive_read(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
-    ESP_LOGI(TAG, "on_drive_read: status=%d", e->status);
+    DLOGD(LOG_BLE, 0, "on_drive_read: status=%d", e->status);
     if (e->status == 0 && a) {
         uint8_t d[8];
         uint16_t l = OS_MBUF_PKTLEN(a->om);
         if (l > 8) l = 8;
         os_mbuf_copydata(a->om, 0, l, d);
-        ESP_LOGI(TAG, "Mode raw: len=%d, [%02X %02X %02X %02X]", l, d[0], d[1], d[2], d[3]);
+        DLOGD(LOG_BLE, 0, "Mode raw: len=%d, [%02X %02X %02X %02X]", l, d[0], d[1], d[2], d[3]);
         if (l >= 1) {
-            drive_mode = d[0];
-            ESP_LOGI(TAG, "Mode: %d", drive_mode);
+            state_begin()->drive_mode = d[0];
+            state_end();
+            DLOGI(LOG_BLE, 0, "Mode: %d", d[0]);
             mqtt_publish_state();  // Update HA when mode changes
         }
     }
     return 0;
 }
 
-static int on_led_read(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
-    if (e->status == 0 && a) {
-        uint8_t d[8];
-        uint16_t l = OS_MBUF_PKTLEN(a->om);
-        if (l > 8) l = 8;
-        os_mbuf_copydata(a->om, 0, l, d);
-        if (l >= 1) {
-            battery_leds = d[0];
-            ESP_LOGI(TAG, "LEDs: %d", battery_leds);
+// BLE command executor
+// All GATT writes go through one task. Each characteristic has a single pending
+// slot, so a burst of commands (e.g. dragging the intensity slider) collapses
+// to the latest value. Local state is only updated once the write is acked.
+// Commands wait in their slot while BLE is down, but not forever: "start
+// rocking" should not fire an hour later when the stroller comes back.
+#define CMD_QUEUE_LEN 8
+#define CMD_WRITE_TIMEOUT_MS 2000
+#define CMD_EXPIRE_MS 60000
+#define CMD_RESULT_SLOTS 8
+#define CMD_WAITER_SLOTS 4
+
+typedef enum { CMD_CHR_MODE, CMD_CHR_ROCK, CMD_CHR_COUNT } cmd_chr_t;
+typedef enum {
+    CMD_ST_PENDING = 0,
+    CMD_ST_OK,
+    CMD_ST_FAILED,      // write rejected or ATT error
+    CMD_ST_TIMEOUT,     // no write response within CMD_WRITE_TIMEOUT_MS
+    CMD_ST_SUPERSEDED,  // replaced by a newer command on the same characteristic
+    CMD_ST_EXPIRED,     // BLE not ready within CMD_EXPIRE_MS
+} cmd_status_t;
+
+typedef struct {
+    uint32_t id;
+    uint8_t data[3];
+    uint8_t len;
+    int64_t submit_us;
+} ble_cmd_t;
+
+typedef struct {
+    uint32_t id;
+    cmd_status_t status;
+    int att_status;
+    uint32_t latency_ms;
+} cmd_result_t;
+
+typedef struct {
+    uint32_t id;  // 0 = free
+    SemaphoreHandle_t sem;
+    cmd_result_t result;
+} cmd_waiter_t;
+
+static QueueHandle_t cmd_queue = NULL;
+static SemaphoreHandle_t cmd_lock = NULL;
+static SemaphoreHandle_t cmd_ack_sem = NULL;
+static ble_cmd_t cmd_slot[CMD_CHR_COUNT];
+static uint32_t cmd_next_id = 1;
+static volatile uint32_t cmd_inflight_id = 0;
+static volatile int cmd_ack_status = 0;
+static cmd_result_t cmd_results[CMD_RESULT_SLOTS];
+static int cmd_result_pos = 0;
+static cmd_waiter_t cmd_waiters[CMD_WAITER_SLOTS];
+static cmd_result_t cmd_last_result;
+static volatile uint32_t cmd_expired = 0;
+
+static const char *cmd_status_str(cmd_status_t st) {
+    switch (st) {
+        case CMD_ST_PENDING: return "pending";
+        case CMD_ST_OK: return "ok";
+        case CMD_ST_FAILED: return "failed";
+        case CMD_ST_TIMEOUT: return "timeout";
+        case CMD_ST_SUPERSEDED: return "superseded";
+        case CMD_ST_EXPIRED: return "expired";
+    }
+    return "?";
+}
+
+// Record a final result and wake anyone waiting for it. Caller holds cmd_lock.
+static void cmd_finish_locked(uint32_t id, cmd_status_t status, int att_status, int64_t submit_us) {
+    cmd_result_t r = {
+        .id = id, .status = status, .att_status = att_status,
+        .latency_ms = (uint32_t)((esp_timer_get_time() - submit_us) / 1000),
+    };
+    cmd_results[cmd_result_pos] = r;
+    cmd_result_pos = (cmd_result_pos + 1) % CMD_RESULT_SLOTS;
+    cmd_last_result = r;
+    for (int i = 0; i < CMD_WAITER_SLOTS; i++) {
+        if (cmd_waiters[i].id == id) {
+            cmd_waiters[i].result = r;
+            xSemaphoreGive(cmd_waiters[i].sem);
         }
     }
-    process_pending_commands();
-    return 0;
+}
+
+// Queue a write; returns the command id (0 on error)
+static uint32_t ble_cmd_submit(cmd_chr_t chr, const uint8_t *data, uint8_t len) {
+    if (!cmd_queue || len > sizeof(cmd_slot[0].data)) return 0;
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    ble_cmd_t *slot = &cmd_slot[chr];
+    if (slot->id) {
+        // Latest wins: the older command is dropped before it is sent
+        cmd_finish_locked(slot->id, CMD_ST_SUPERSEDED, 0, slot->submit_us);
+    }
+    uint32_t id = cmd_next_id++;
+    if (cmd_next_id == 0) cmd_next_id = 1;
+    slot->id = id;
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->submit_us = esp_timer_get_time();
+    xSemaphoreGive(cmd_lock);
+    uint8_t c = chr;
+    xQueueSend(cmd_queue, &c, 0);  // Full queue is fine, the slot is still picked up
+    return id;
+}
+
+static uint32_t ble_cmd_set_mode(int mode) {
+    uint8_t m = mode;
+    return ble_cmd_submit(CMD_CHR_MODE, &m, 1);
+}
+
+// Format: [0x01, minutes (0=continuous), intensity%]
+static uint32_t ble_cmd_rock_start(void) {
+    bridge_state_t st;
+    state_get(&st);
+    uint8_t cmd[3] = {0x01, st.rock_minutes, st.intensity};
+    return ble_cmd_submit(CMD_CHR_ROCK, cmd, 3);
+}
+
+static uint32_t ble_cmd_rock_stop(void) {
+    uint8_t cmd = 0x00;
+    return ble_cmd_submit(CMD_CHR_ROCK, &cmd, 1);
+}
+
+// Block until command id completes or timeout_ms passes. Returns false on timeout
+// (the command itself stays queued, e.g. until BLE reconnects).
+static bool ble_cmd_wait(uint32_t id, uint32_t timeout_ms, cmd_result_t *out) {
+    if (!id) return false;
+    cmd_waiter_t *w = NULL;
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    for (int i = 0; i < CMD_RESULT_SLOTS; i++) {
+        if (cmd_results[i].id == id) {
+            if (out) *out = cmd_results[i];
+            xSemaphoreGive(cmd_lock);
+            return true;
+        }
+    }
+    for (int i = 0; i < CMD_WAITER_SLOTS && !w; i++) {
+        if (cmd_waiters[i].id == 0) w = &cmd_waiters[i];
+    }
+    if (w) {
+        xSemaphoreTake(w->sem, 0);  // Drop a stale give from an earlier timed-out wait
+        w->id = id;
+    }
+    xSemaphoreGive(cmd_lock);
+    if (!w) return false;
+
+    bool done = xSemaphoreTake(w->sem, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    if (done && out) *out = w->result;
+    w->id = 0;
+    xSemaphoreGive(cmd_lock);
+    return done;
+}
+
+static void ble_cmd_kick(void) {
+    uint8_t c = CMD_CHR_COUNT;
+    if (cmd_queue) xQueueSend(cmd_queue, &c, 0);
 }
 
 static int on_write(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
     last_write_status = e->status;
-    ESP_LOGI(TAG, "Write callback: status=%d", e->status);
+    if (e->status == 0) link_alive();
+    DLOGD(LOG_CMD, 0, "Write callback: status=%d", e->status);
+    // Ignore late acks for a command the executor already gave up on
+    if ((uint32_t)(uintptr_t)arg == cmd_inflight_id) {
+        cmd_ack_status = e->status;
+        xSemaphoreGive(cmd_ack_sem);
+    }
     return 0;
 }
 
-static void subscribe_to_notifications(void) {
-    if (!ble_connected) return;
-    
-    // Subscribe to STATUS notifications (handle + 1 is typically CCCD)
-    if (status_val_handle) {
-        uint8_t val[2] = {0x01, 0x00};  // Enable notifications
-        ble_gattc_write_flat(conn_handle, status_val_handle + 1, val, 2, NULL, NULL);
-        ESP_LOGI(TAG, "Subscribed to STATUS notify");
+// Apply the effect of an acked write to local state
+static void cmd_apply(cmd_chr_t chr, const ble_cmd_t *cmd) {
+    bridge_state_t *s = state_begin();
+    if (chr == CMD_CHR_MODE) {
+        s->drive_mode = cmd->data[0];
+    } else if (cmd->data[0] == 0x01) {
+        s->rocking = true;
+        s->rock_start_s = esp_timer_get_time() / 1000000;
+    } else {
+        s->rocking = false;
     }
-    vTaskDelay(pdMS_TO_TICKS(100));
-    
-    // Subscribe to DRIVE MODE notifications
-    if (drive_mode_val_handle) {
-        uint8_t val[2] = {0x01, 0x00};
-        ble_gattc_write_flat(conn_handle, drive_mode_val_handle + 1, val, 2, NULL, NULL);
-        ESP_LOGI(TAG, "Subscribed to MODE notify");
+    state_end();
+    session_acked(cmd->id);
+}
+
+static void cmd_execute(cmd_chr_t chr) {
+    uint16_t handle = chr == CMD_CHR_MODE ? drive_mode_val_handle : rocking_val_handle;
+    if (conn_state != CONN_READY || !handle) return;  // Stays queued until ready
+
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    ble_cmd_t cmd = cmd_slot[chr];
+    cmd_slot[chr].id = 0;
+    xSemaphoreGive(cmd_lock);
+    if (!cmd.id) return;
+
+    DLOGI(LOG_CMD, 0, "cmd #%lu: write %d bytes to handle %d", cmd.id, cmd.len, handle);
+    // Don't wait for the update; this write goes out at the current interval,
+    // the rest of a burst at the fast one
+    connparam_request(CONNPARAM_FAST);
+    xSemaphoreTake(cmd_ack_sem, 0);
+    cmd_inflight_id = cmd.id;
+    int64_t sent_us = esp_timer_get_time();
+    last_write_rc = ble_gattc_write_flat(conn_handle, handle, cmd.data, cmd.len,
+                                        on_write, (void *)(uintptr_t)cmd.id);
+    cmd_status_t st;
+    int att = 0;
+    if (last_write_rc != 0) {
+        st = CMD_ST_FAILED;
+        att = last_write_rc;
+    } else if (xSemaphoreTake(cmd_ack_sem, pdMS_TO_TICKS(CMD_WRITE_TIMEOUT_MS)) != pdTRUE) {
+        st = CMD_ST_TIMEOUT;
+    } else {
+        att = cmd_ack_status;
+        st = att == 0 ? CMD_ST_OK : CMD_ST_FAILED;
+        connparam_record_rtt((uint32_t)((esp_timer_get_time() - sent_us) / 1000));
     }
-    vTaskDelay(pdMS_TO_TICKS(100));
-    
-    // Subscribe to ROCKING notifications
-    if (rocking_val_handle) {
-        uint8_t val[2] = {0x01, 0x00};
-        ble_gattc_write_flat(conn_handle, rocking_val_handle + 1, val, 2, NULL, NULL);
-        ESP_LOGI(TAG, "Subscribed to ROCK notify");
+    cmd_inflight_id = 0;
+    connparam_idle_later();
+
+    if (st == CMD_ST_OK) cmd_apply(chr, &cmd);
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    cmd_finish_locked(cmd.id, st, att, cmd.submit_us);
+    xSemaphoreGive(cmd_lock);
+    DLOGI(LOG_CMD, 0, "cmd #%lu: %s (%d)", cmd.id, DLOG_STR(cmd_status_str(st)), att);
+    if (st != CMD_ST_OK) ev_log(EV_WRITE_FAILED, cmd_status_str(st), cmd.id, att, NULL);
+    mqtt_publish_state();
+}
+
+// Drop commands that have waited too long for the link
+static void cmd_expire(void) {
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    for (int chr = 0; chr < CMD_CHR_COUNT; chr++) {
+        ble_cmd_t *slot = &cmd_slot[chr];
+        if (slot->id && now - slot->submit_us > CMD_EXPIRE_MS * 1000LL) {
+            DLOGW(LOG_CMD, 0, "cmd #%lu: expired", slot->id);
+            ev_log(EV_CMD_EXPIRED, NULL, slot->id, 0, NULL);
+            cmd_finish_locked(slot->id, CMD_ST_EXPIRED, 0, slot->submit_us);
+            slot->id = 0;
+            cmd_expired++;
+        }
     }
+    xSemaphoreGive(cmd_lock);
 }
 
-static void read_all_characteristics(void) {
-    if (!ble_connected || !chars_discovered) return;
-    if (status_val_handle) ble_gattc_read(conn_handle, status_val_handle, on_status_read, NULL);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    if (battery_led_val_handle) ble_gattc_read(conn_handle, battery_led_val_handle, on_led_read, NULL);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    
-    // Subscribe to notifications for live updates
-    subscribe_to_notifications();
-}
-
-static void process_pending_commands(void) {
-    ESP_LOGI(TAG, "process_pending: mode=%d, rock_start=%d, rock_stop=%d, connected=%d, chars=%d",
-        pending_mode, pending_rock_start, pending_rock_stop, ble_connected, chars_discovered);
-    if (!ble_connected || !chars_discovered) return;
-    if (pending_mode > 0 && drive_mode_val_handle) {
-        uint8_t m = pending_mode;
-        pending_mode = 0;
-        ESP_LOGI(TAG, "Writing mode %d to handle %d (conn=%d)", m, drive_mode_val_handle, conn_handle);
-        last_write_rc = ble_gattc_write_flat(conn_handle, drive_mode_val_handle, &m, 1, on_write, NULL);
-        ESP_LOGI(TAG, "Write rc=%d", last_write_rc);
-        if (last_write_rc == 0) {
-            drive_mode = m;  // Update local state on successful write
-            mqtt_publish_state();
+// Ticks until the oldest queued command expires; forever when none is queued
+static TickType_t cmd_next_expiry(void) {
+    int64_t first = 0;
+    xSemaphoreTake(cmd_lock, portMAX_DELAY);
+    for (int chr = 0; chr < CMD_CHR_COUNT; chr++) {
+        if (cmd_slot[chr].id && (!first || cmd_slot[chr].submit_us < first)) first = cmd_slot[chr].submit_us;
+    }
+    xSemaphoreGive(cmd_lock);
+    if (!first) return portMAX_DELAY;
+    int64_t left_ms = (first + CMD_EXPIRE_MS * 1000LL - esp_timer_get_time()) / 1000;
+    return left_ms > 0 ? pdMS_TO_TICKS(left_ms) + 1 : 0;
+}
+
+static void ble_cmd_task(void *arg) {
+    uint8_t c;
+    while (1) {
+        xQueueReceive(cmd_queue, &c, cmd_next_expiry());
+        cmd_expire();
+        // Any wakeup drains every slot; one write in flight at a time
+        for (int chr = 0; chr < CMD_CHR_COUNT; chr++) {
+            cmd_execute((cmd_chr_t)chr);
+        }
+    }
+}
+
+static void ble_cmd_init(void) {
+    cmd_queue = xQueueCreate(CMD_QUEUE_LEN, sizeof(uint8_t));
+    cmd_lock = xSemaphoreCreateMutex();
+    cmd_ack_sem = xSemaphoreCreateBinary();
+    for (int i = 0; i < CMD_WAITER_SLOTS; i++) {
+        cmd_waiters[i].sem = xSemaphoreCreateBinary();
+    }
+    xTaskCreate(ble_cmd_task, "ble_cmd", 4096, NULL, 6, NULL);
+}
+
+static void reset_handles(void) {
+    status_val_handle = 0;
+    drive_mode_val_handle = 0;
+    rocking_val_handle = 0;
+    battery_led_val_handle = 0;
+    status_cccd_handle = 0;
+    drive_mode_cccd_handle = 0;
+    rocking_cccd_handle = 0;
+    memset(chr_end_handle, 0, sizeof(chr_end_handle));
+}
+
+// Forget the current link (host task)
+static void conn_teardown(void) {
+    ble_npl_callout_stop(&connparam_timer);
+    connparam_requested = -1;
+    link_stop();
+    conn_itvl = 0;
+    conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    ble_connected = false;
+    priam_found = false;
+    have_candidate = false;
+    chars_discovered = false;
+    bridge_state_t *s = state_begin();
+    s->battery = -1;
+    s->battery_leds = -1;
+    s->drive_mode = -1;
+    s->rocking = false;
+    state_end();
+    reset_handles();
+    mqtt_publish_state();  // Update HA immediately
+}
+
+// Post-connect setup
+// Each step is started from the previous step's completion callback on the
+// host task: discover services/characteristics, discover descriptors for the
+// real CCCDs, read STATUS then BATTERY_LED (ATT allows one request at a time),
+// then the CCCD writes one after another. With cached handles only the last two run.
+typedef enum { SETUP_DISCOVER, SETUP_DESCRIPTORS, SETUP_READ, SETUP_SUBSCRIBE, SETUP_PHASES } setup_phase_t;
+
+static const char *const setup_phase_names[] = { "discover", "descriptors", "read", "subscribe" };
+
+static volatile uint32_t setup_phase_ms[SETUP_PHASES];
+static int64_t setup_phase_start = 0;
+
+static void setup_begin(void) {
+    memset((void *)setup_phase_ms, 0, sizeof(setup_phase_ms));
+    setup_phase_start = esp_timer_get_time();
+}
+
+static void setup_phase_done(setup_phase_t ph) {
+    int64_t now = esp_timer_get_time();
+    setup_phase_ms[ph] = (uint32_t)((now - setup_phase_start) / 1000);
+    setup_phase_start = now;
+}
+
+static void setup_fail(const char *step, int status) {
+    ESP_LOGE(TAG, "Setup %s failed: %d, dropping link", step, status);
+    ev_log(EV_SETUP_FAILED, step, status, 0, NULL);
+    if (ble_connected) ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+static void setup_discover(void);
+
+static void setup_ready(void) {
+    setup_phase_done(SETUP_SUBSCRIBE);
+    DLOGI(LOG_BLE, 0, "Setup: discover=%lu descriptors=%lu read=%lu subscribe=%lu ms",
+        setup_phase_ms[SETUP_DISCOVER], setup_phase_ms[SETUP_DESCRIPTORS],
+        setup_phase_ms[SETUP_READ], setup_phase_ms[SETUP_SUBSCRIBE]);
+    conn_set_state(CONN_READY);
+    link_start();
+    connparam_idle_later();
+    ble_cmd_kick();  // Send anything queued while disconnected
+}
+
+// arg is the index of the CCCD just written; write the next one that exists
+static int on_cccd_write(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
+    static const uint8_t enable[2] = {0x01, 0x00};  // Enable notifications
+    const uint16_t cccd[3] = {status_cccd_handle, drive_mode_cccd_handle, rocking_cccd_handle};
+    int next = (int)(intptr_t)arg;
+    if (next >= 0 && e->status != 0) {
+        // Not fatal: we just lose live updates for that characteristic
+        DLOGW(LOG_BLE, 0, "CCCD %d write failed: %d", cccd[next], e->status);
+    }
+    for (next++; next < 3; next++) {
+        if (!cccd[next]) continue;
+        int rc = ble_gattc_write_flat(conn_handle, cccd[next], enable, sizeof(enable),
+                                      on_cccd_write, (void *)(intptr_t)next);
+        if (rc != 0) setup_fail("subscribe", rc);
+        return 0;
+    }
+    setup_ready();
+    return 0;
+}
+
+static void setup_subscribe(void) {
+    struct ble_gatt_error none = {0};
+    on_cccd_write(conn_handle, &none, NULL, (void *)(intptr_t)-1);
+}
+
+// Not fatal if it fails: the LEDs are only shown, and notifies update them
+static int on_led_read(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
+    if (e->status == 0 && a && OS_MBUF_PKTLEN(a->om) >= 1) {
+        uint8_t leds;
+        os_mbuf_copydata(a->om, 0, 1, &leds);
+        state_begin()->battery_leds = leds;
+        state_end();
+        mqtt_publish_state();
+    }
+    if (!ble_connected) return 0;
+    setup_phase_done(SETUP_READ);
+    setup_subscribe();
+    return 0;
+}
+
+// Last step of SETUP_READ, once the handles are known to be good
+static void setup_read_led(void) {
+    if (battery_led_val_handle && ble_gattc_read(conn_handle, battery_led_val_handle, on_led_read, NULL) == 0) return;
+    setup_phase_done(SETUP_READ);
+    setup_subscribe();
+}
+
+static int on_setup_read(uint16_t ch, const struct ble_gatt_error *e, struct ble_gatt_attr *a, void *arg) {
+    uint8_t d[24];
+    uint16_t l = 0;
+    if (e->status == 0 && a) {
+        l = OS_MBUF_PKTLEN(a->om);
+        if (l > sizeof(d)) l = sizeof(d);
+        os_mbuf_copydata(a->om, 0, l, d);
+    }
+    if (l < 4) {
+        if (!ble_connected) return 0;
+        if (handles_from_cache) {
+            // Cached handles no longer point at the right attributes
+            peer_cache_misses++;
+            DLOGW(LOG_BLE, 0, "Handle cache miss (status=%d, len=%d), full discovery", e->status, l);
+            ev_log(EV_CACHE_STALE, NULL, 0, 0, NULL);
+            peer_cache_valid = false;
+            handles_from_cache = false;
+            setup_discover();
+        } else {
+            setup_fail("read", e->status ? e->status : l);
         }
-        vTaskDelay(pdMS_TO_TICKS(300));
+        return 0;
     }
-    if (pending_rock_start && rocking_val_handle) {
-        pending_rock_start = 0;
-        // Format: [0x01, minutes (0=continuous), intensity%]
-        uint8_t cmd[3] = {0x01, (uint8_t)rock_minutes, (uint8_t)rock_intensity};
-        ESP_LOGI(TAG, "Rock start: %d min, %d%%", rock_minutes, rock_intensity);
-        ble_gattc_write_flat(conn_handle, rocking_val_handle, cmd, 3, on_write, NULL);
-        is_rocking = true;
-        rock_start_time = esp_timer_get_time() / 1000000;  // Set start time in seconds
+    if (handles_from_cache) {
+        peer_cache_hits++;
+        DLOGI(LOG_BLE, 0, "Handle cache hit");
+        service_found = true;
+        service_start_handle = peer_cache.svc_start;
+        service_end_handle = peer_cache.svc_end;
+        chars_discovered = true;
     }
-    if (pending_rock_stop && rocking_val_handle) {
-        pending_rock_stop = 0;
-        uint8_t cmd = 0x00;
-        ble_gattc_write_flat(conn_handle, rocking_val_handle, &cmd, 1, on_write, NULL);
-        is_rocking = false;
+    int percent = status_battery_pct(d);
+    state_begin()->battery = percent;
+    state_end();
+    DLOGI(LOG_BLE, 0, "Batt: %d%%", percent);
+    mqtt_publish_state();
+    setup_read_led();
+    return 0;
+}
+
+static void setup_read(void) {
+    if (!status_val_handle) {
+        if (handles_from_cache) {
+            // Nothing to check the cache against
+            peer_cache_valid = false;
+            handles_from_cache = false;
+            setup_discover();
+            return;
+        }
+        setup_read_led();
+        return;
+    }
+    int rc = ble_gattc_read(conn_handle, status_val_handle, on_setup_read, NULL);
+    if (rc != 0) setup_fail("read", rc);
+}
+
+// All-descriptor discovery reports the range start as chr_val_handle, so a
+// descriptor belongs to the characteristic whose value handle and end (the next
+// declaration, from on_chr) enclose it; others' CCCDs are left alone
+static void dsc_assign_cccd(uint16_t dsc_handle) {
+    const uint16_t vals[3] = {status_val_handle, drive_mode_val_handle, rocking_val_handle};
+    uint16_t *const cccds[3] = {&status_cccd_handle, &drive_mode_cccd_handle, &rocking_cccd_handle};
+    for (int i = 0; i < 3; i++) {
+        if (vals[i] && vals[i] < dsc_handle && dsc_handle <= chr_end_handle[i]) *cccds[i] = dsc_handle;
+    }
+}
+
+// Each declaration ends the characteristic before it
+static void chr_close_before(uint32_t def_handle) {
+    const uint16_t vals[3] = {status_val_handle, drive_mode_val_handle, rocking_val_handle};
+    for (int i = 0; i < 3; i++) {
+        if (vals[i] && !chr_end_handle[i] && def_handle > vals[i]) chr_end_handle[i] = def_handle - 1;
+    }
+}
+
+static int on_dsc(uint16_t ch, const struct ble_gatt_error *e, uint16_t chr_val_handle,
+                  const struct ble_gatt_dsc *dsc, void *arg) {
+    if (e->status == 0 && dsc) {
+        if (ble_uuid_cmp(&dsc->uuid.u, BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16)) == 0) {
+            dsc_assign_cccd(dsc->handle);
+        }
+    } else if (e->status == BLE_HS_EDONE) {
+        DLOGI(LOG_BLE, 0, "CCCDs: %d,%d,%d", status_cccd_handle, drive_mode_cccd_handle, rocking_cccd_handle);
+        save_peer_cache();
+        setup_phase_done(SETUP_DESCRIPTORS);
+        setup_read();
+    } else {
+        setup_fail("descriptor discovery", e->status);
     }
+    return 0;
 }
 
 static int on_chr(uint16_t ch, const struct ble_gatt_error *e, const struct ble_gatt_chr *c, void *arg) {
     if (e->status == 0 && c) {
+        chr_close_before(c->def_handle);
         if (ble_uuid_cmp(&c->uuid.u, &STATUS_CHAR_UUID.u) == 0) {
             status_val_handle = c->val_handle;
-            ESP_LOGI(TAG, "STATUS: %d", c->val_handle);
+            DLOGD(LOG_BLE, 0, "STATUS: %d", c->val_handle);
         } else if (ble_uuid_cmp(&c->uuid.u, &DRIVE_MODE_CHAR_UUID.u) == 0) {
             drive_mode_val_handle = c->val_handle;
-            ESP_LOGI(TAG, "MODE: %d", c->val_handle);
+            DLOGD(LOG_BLE, 0, "MODE: %d", c->val_handle);
         } else if (ble_uuid_cmp(&c->uuid.u, &ROCKING_CHAR_UUID.u) == 0) {
             rocking_val_handle = c->val_handle;
-            ESP_LOGI(TAG, "ROCK: %d", c->val_handle);
+            DLOGD(LOG_BLE, 0, "ROCK: %d", c->val_handle);
         } else if (ble_uuid_cmp(&c->uuid.u, &BATTERY_LED_CHAR_UUID.u) == 0) {
             battery_led_val_handle = c->val_handle;
-            ESP_LOGI(TAG, "LED: %d", c->val_handle);
+            DLOGD(LOG_BLE, 0, "LED: %d", c->val_handle);
         }
     } else if (e->status == BLE_HS_EDONE) {
-        ESP_LOGI(TAG, "Chars done: %d,%d,%d,%d", status_val_handle, drive_mode_val_handle, rocking_val_handle, battery_led_val_handle);
+        DLOGI(LOG_BLE, 0, "Chars done: %d,%d,%d,%d", status_val_handle, drive_mode_val_handle, rocking_val_handle, battery_led_val_handle);
         if (status_val_handle || drive_mode_val_handle) {
             chars_discovered = true;
-            vTaskDelay(pdMS_TO_TICKS(200));
-            read_all_characteristics();
+            setup_phase_done(SETUP_DISCOVER);
+            // Descriptors sit between the first value handle and the end of the service
+            uint16_t start = 0xFFFF;
+            if (status_val_handle && status_val_handle < start) start = status_val_handle;
+            if (drive_mode_val_handle && drive_mode_val_handle < start) start = drive_mode_val_handle;
+            if (rocking_val_handle && rocking_val_handle < start) start = rocking_val_handle;
+            uint16_t end = service_found ? service_end_handle : 0xFFFF;
+            chr_close_before((uint32_t)end + 1);  // The last one runs to the end of the service
+            int rc = ble_gattc_disc_all_dscs(conn_handle, start, end, on_dsc, NULL);
+            if (rc != 0) setup_fail("descriptor discovery", rc);
+        } else {
+            ESP_LOGE(TAG, "No E-Priam characteristics, dropping link");
+            ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
         }
+    } else {
+        setup_fail("char discovery", e->status);
     }
     return 0;
 }
@@ -395,7 +1575,7 @@ static int on_chr(uint16_t ch, const struct ble_gatt_error *e, const struct ble_
 static int on_svc(uint16_t ch, const struct ble_gatt_error *e, const struct ble_gatt_svc *s, void *arg) {
     if (e->status == 0 && s) {
         if (ble_uuid_cmp(&s->uuid.u, &PRIAM_SERVICE_UUID.u) == 0) {
-            ESP_LOGI(TAG, "*** Found service! ***");
+            DLOGI(LOG_BLE, 0, "*** Found service! ***");
             service_found = true;
             service_start_handle = s->start_handle;
             service_end_handle = s->end_handle;
@@ -406,101 +1586,267 @@ static int on_svc(uint16_t ch, const struct ble_gatt_error *e, const struct ble_
         } else {
             ble_gattc_disc_all_chrs(conn_handle, 1, 0xFFFF, on_chr, NULL);
         }
+    } else {
+        setup_fail("service discovery", e->status);
     }
     return 0;
 }
 
-static void connect_to_priam(ble_addr_t *addr) {
+static void setup_discover(void) {
+    service_found = false;
+    chars_discovered = false;
+    reset_handles();
+    int rc = ble_gattc_disc_all_svcs(conn_handle, on_svc, NULL);
+    if (rc != 0) setup_fail("service discovery", rc);
+}
+
+// Known peer: reuse the cached handles; the first read doubles as the check
+static void setup_from_cache(void) {
+    status_val_handle = peer_cache.status;
+    drive_mode_val_handle = peer_cache.mode;
+    rocking_val_handle = peer_cache.rock;
+    battery_led_val_handle = peer_cache.led;
+    status_cccd_handle = peer_cache.status_cccd;
+    drive_mode_cccd_handle = peer_cache.mode_cccd;
+    rocking_cccd_handle = peer_cache.rock_cccd;
+    handles_from_cache = true;
+    setup_read();
+}
+
+// Seen-device table
+// One slot per address heard while scanning (open addressing on an FNV hash of
+// the address, stalest entry evicted when full). Each address is logged once,
+// when first seen, and E-Priam candidates are ranked from here instead of
+// connecting to whichever advert arrived first.
+#define SEEN_SLOTS 32              // Power of two
+#define CANDIDATE_SETTLE_MS 1000   // Collect sightings this long before picking one
+
+typedef struct {
+    ble_addr_t addr;
+    bool used;
+    bool priam;
+    int32_t mfg_id;      // -1 = none
+    int16_t rssi_x16;    // Moving average, 1/16 dBm
+    uint16_t count;
+    int32_t cycle;       // Scan cycle of the last sighting
+    uint32_t last_ms;
+    char name[20];
+} seen_dev_t;
+
+static seen_dev_t seen[SEEN_SLOTS];
+static portMUX_TYPE seen_mux = portMUX_INITIALIZER_UNLOCKED;
+static volatile int seen_count = 0;  // Slots in use, at most SEEN_SLOTS
+static struct ble_npl_callout cand_timer;
+
+static void addr_to_str(const ble_addr_t *a, char out[18]) {
+    snprintf(out, 18, "%02X:%02X:%02X:%02X:%02X:%02X",
+        a->val[5], a->val[4], a->val[3], a->val[2], a->val[1], a->val[0]);
+}
+
+// Host task only
+static void seen_update(const struct ble_gap_disc_desc *disc, const adv_info_t *info, bool priam) {
+    uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+    uint32_t i = fnv1a(&disc->addr, sizeof(disc->addr), FNV1A_INIT) & (SEEN_SLOTS - 1);
+    seen_dev_t *d = NULL, *stalest = NULL;
+    for (int n = 0; n < SEEN_SLOTS; n++, i = (i + 1) & (SEEN_SLOTS - 1)) {
+        if (!seen[i].used || ble_addr_cmp(&seen[i].addr, &disc->addr) == 0) {
+            d = &seen[i];
+            break;
+        }
+        if (!stalest || (int32_t)(seen[i].last_ms - stalest->last_ms) < 0) stalest = &seen[i];
+    }
+    bool is_new = !d || !d->used;
+    bool took_free = d && !d->used;
+    bool newly_priam = priam && (is_new || !d->priam);
+
+    portENTER_CRITICAL(&seen_mux);
+    if (!d) d = stalest;  // Full: reuse the slot, probe chains stay intact
+    if (is_new) {
+        memset(d, 0, sizeof(*d));
+        d->used = true;
+        d->addr = disc->addr;
+        d->mfg_id = -1;
+        d->rssi_x16 = disc->rssi * 16;
+    } else {
+        d->rssi_x16 += (disc->rssi * 16 - d->rssi_x16) / 4;
+    }
+    if (info->name[0]) memcpy(d->name, info->name, sizeof(d->name));
+    if (info->mfg_id >= 0) d->mfg_id = info->mfg_id;
+    d->priam |= priam;
+    if (d->count < UINT16_MAX) d->count++;
+    d->cycle = scan_cycle_count;
+    d->last_ms = now;
+    portEXIT_CRITICAL(&seen_mux);
+
+    if (is_new || newly_priam) {
+        char addr_str[18];
+        addr_to_str(&disc->addr, addr_str);
+        if (took_free) seen_count++;  // Occupied slots; evictions reuse one
+        if (newly_priam) {
+            ESP_LOGI(TAG, "*** E-Priam: %s %s (type=%d) ***", d->name, addr_str, disc->addr.type);
+            ev_log(EV_FOUND, NULL, disc->rssi, 0, &disc->addr);
+        } else if (d->name[0]) {
+            ev_log(EV_SEEN, NULL, disc->rssi, 0, &disc->addr);
+        } else if (d->mfg_id >= 0) {
+            ev_log(EV_SEEN_MFG, NULL, d->mfg_id, disc->rssi, &disc->addr);
+        }
+    }
+}
+
+// Rank by averaged RSSI with a bonus for repeat sightings. Random addresses
+// connect more reliably than the RN4871's public one, and the cached peer is
+// preferred when it is in range.
+static int seen_score(const seen_dev_t *d) {
+    int s = d->rssi_x16 / 16;
+    s += d->count < 8 ? d->count : 8;
+    if (d->addr.type == BLE_ADDR_RANDOM) s += 10;
+    if (peer_cache_valid && ble_addr_cmp(&d->addr, &peer_cache.addr) == 0) s += 5;
+    return s;
+}
+
+// Best E-Priam heard during the current scan cycle, or NULL
+static seen_dev_t *seen_best(void) {
+    seen_dev_t *best = NULL;
+    int best_score = 0;
+    for (int i = 0; i < SEEN_SLOTS; i++) {
+        seen_dev_t *d = &seen[i];
+        if (!d->used || !d->priam || d->cycle != scan_cycle_count) continue;
+        int sc = seen_score(d);
+        if (!best || sc > best_score) {
+            best = d;
+            best_score = sc;
+        }
+    }
+    return best;
+}
+
+static void connect_to_priam(ble_addr_t *addr, int32_t timeout_ms) {
     char addr_str[18];
-    snprintf(addr_str, sizeof(addr_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-        addr->val[5], addr->val[4], addr->val[3], addr->val[2], addr->val[1], addr->val[0]);
+    addr_to_str(addr, addr_str);
     
     ESP_LOGI(TAG, "Connecting to %s (type=%d)...", addr_str, addr->type);
-    web_log_add("Connecting to %s (type=%d)...", addr_str, addr->type);
+    ev_log(EV_CONNECTING, NULL, 0, 0, addr);
     
     memcpy(&priam_addr, addr, sizeof(ble_addr_t));
     priam_found = true;
+    have_candidate = false;
+    ble_npl_callout_stop(&cand_timer);
     
     ble_gap_disc_cancel();
     
     service_found = false;
     chars_discovered = false;
-    status_val_handle = 0;
-    drive_mode_val_handle = 0;
-    rocking_val_handle = 0;
-    battery_led_val_handle = 0;
+    reset_handles();
+    handles_from_cache = false;
     
-    last_connect_rc = ble_gap_connect(own_addr_type, &priam_addr, 30000, NULL, ble_gap_event, NULL);
-    ESP_LOGI(TAG, "ble_gap_connect rc=%d", last_connect_rc);
+    last_connect_rc = ble_gap_connect(own_addr_type, &priam_addr, timeout_ms, NULL, ble_gap_event, NULL);
+    DLOGD(LOG_BLE, 0, "ble_gap_connect rc=%d", last_connect_rc);
     if (last_connect_rc != 0) {
-        ESP_LOGE(TAG, "Connect failed: %d", last_connect_rc);
-        web_log_add("Connect failed: rc=%d", last_connect_rc);
+        DLOGE(LOG_BLE, 0, "Connect failed: %d", last_connect_rc);
+        ev_log(EV_CONNECT_RC, NULL, last_connect_rc, 0, NULL);
         priam_found = false;
-        have_candidate = false;
+        conn_via_cache = false;
+        conn_schedule_retry(last_connect_rc);
+    } else {
+        conn_set_state(CONN_CONNECTING);
+    }
+}
+
+// Reconnect entry point: direct connect to the cached peer once, then scan
+static void conn_start(void) {
+    if (peer_cache_valid && !conn_cache_tried) {
+        conn_cache_tried = true;
+        conn_via_cache = true;
+        ev_log(EV_DIRECT, NULL, 0, 0, NULL);
+        connect_to_priam(&peer_cache.addr, CACHED_CONNECT_TIMEOUT_MS);
+    } else {
+        ble_app_scan();
     }
 }
 
+static bool connect_best_candidate(void) {
+    seen_dev_t *best = seen_best();
+    if (!best) return false;
+    ble_addr_t addr = best->addr;
+    ESP_LOGI(TAG, "Best of %d devices: %s rssi=%d seen=%d", seen_count, best->name,
+        best->rssi_x16 / 16, best->count);
+    strncpy(last_found_name, best->name, 31);
+    last_found_name[31] = 0;
+    connect_to_priam(&addr, 30000);
+    return true;
+}
+
+// Settle window after the first candidate sighting has passed
+static void cand_timer_cb(struct ble_npl_event *ev) {
+    if (have_candidate && !priam_found && conn_state == CONN_SCANNING) connect_best_candidate();
+}
+
 static int ble_gap_event(struct ble_gap_event *event, void *arg) {
     switch (event->type) {
-        case BLE_GAP_EVENT_DISC:
-            if (!priam_found && is_priam_device(&event->disc)) {
-                char addr_str[18];
-                snprintf(addr_str, sizeof(addr_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-                    event->disc.addr.val[5], event->disc.addr.val[4],
-                    event->disc.addr.val[3], event->disc.addr.val[2],
-                    event->disc.addr.val[1], event->disc.addr.val[0]);
-                ESP_LOGI(TAG, "E-Priam candidate: %s (type=%d)", addr_str, event->disc.addr.type);
-                
-                // Prefer random address (type=1) - connects more reliably
-                if (event->disc.addr.type == 1) {
-                    // Random address found - connect immediately
-                    ESP_LOGI(TAG, "*** Random address - connecting immediately ***");
-                    have_candidate = false;
-                    connect_to_priam((ble_addr_t*)&event->disc.addr);
-                } else if (!have_candidate) {
-                    // Public address - save as fallback, wait for random
-                    ESP_LOGI(TAG, "Public address - saving as fallback");
-                    memcpy(&best_priam_addr, &event->disc.addr, sizeof(ble_addr_t));
-                    have_candidate = true;
-                    candidate_found_time = esp_timer_get_time() / 1000;  // ms
-                }
+        case BLE_GAP_EVENT_DISC: {
+            adv_info_t info;
+            bool priam = is_priam_device(&event->disc, &info);
+            seen_update(&event->disc, &info, priam);
+            if (priam && !priam_found && !have_candidate) {
+                // Give other sightings (e.g. the random address of the same stroller) a moment
+                have_candidate = true;
+                ble_npl_callout_reset(&cand_timer, ble_npl_time_ms_to_ticks32(CANDIDATE_SETTLE_MS));
             }
             break;
+        }
         case BLE_GAP_EVENT_DISC_COMPLETE:
-            ESP_LOGI(TAG, "DISC_COMPLETE: reason=%d, priam_found=%d, have_candidate=%d", 
-                event->disc_complete.reason, priam_found, have_candidate);
+            DLOGD(LOG_SCAN, 0, "DISC_COMPLETE: reason=%d, window=%d, priam_found=%d, have_candidate=%d",
+                event->disc_complete.reason, scan_window_no, priam_found, have_candidate);
+            if (event->disc_complete.reason == 0 && !priam_found && !ble_connected &&
+                conn_state == CONN_SCANNING && scan_window_start()) {
+                break;  // Next window of the same cycle; a candidate waits for cand_timer
+            }
             if (!priam_found && !ble_connected) {
-                if (have_candidate) {
-                    // Try the public address fallback
-                    ESP_LOGI(TAG, "Trying fallback public address...");
-                    connect_to_priam(&best_priam_addr);
+                if (!have_candidate || !connect_best_candidate()) {
+                    // Nothing in range: idle for the rest of the duty cycle
+                    DLOGI(LOG_SCAN, 0, "E-Priam not found, next scan in %d ms (%lu/%lu adverts parsed)",
+                        scan_idle_ms, scan_adv_parsed, scan_adv_rx);
                     have_candidate = false;
-                } else {
-                    ESP_LOGI(TAG, "E-Priam not found, rescanning...");
-                    vTaskDelay(pdMS_TO_TICKS(3000));
-                    ble_app_scan();
+                    conn_schedule(event->disc_complete.reason, scan_idle_ms);
                 }
             }
             break;
         case BLE_GAP_EVENT_CONNECT:
             last_connect_status = event->connect.status;
-            ESP_LOGI(TAG, "CONNECT event: status=%d", event->connect.status);
+            DLOGD(LOG_BLE, 0, "CONNECT event: status=%d", event->connect.status);
             if (event->connect.status == 0) {
                 conn_handle = event->connect.conn_handle;
                 ble_connected = true;
-                ESP_LOGI(TAG, "*** CONNECTED (handle=%d) ***", conn_handle);
-                web_log_add("*** CONNECTED ***");
+                DLOGI(LOG_BLE, 0, "*** CONNECTED (handle=%d) ***", conn_handle);
+                ev_log(EV_CONNECTED, NULL, 0, 0, NULL);
+                conn_connected_us = esp_timer_get_time();
+                conn_via_cache = false;
+                conn_set_state(CONN_DISCOVERING);
+                connparam_requested = -1;
+                connparam_refresh();
+                connparam_request(CONNPARAM_FAST);  // Speeds up discovery and setup
                 mqtt_publish_state();  // Update HA immediately
-                ble_gattc_disc_all_svcs(conn_handle, on_svc, NULL);
+                setup_begin();
+                if (peer_cache_valid && ble_addr_cmp(&priam_addr, &peer_cache.addr) == 0) {
+                    setup_from_cache();
+                } else {
+                    setup_discover();
+                }
             } else {
-                ESP_LOGE(TAG, "Connect failed: status=%d", event->connect.status);
-                web_log_add("Connection failed: %d", event->connect.status);
+                DLOGE(LOG_BLE, 0, "Connect failed: status=%d", event->connect.status);
+                ev_log(EV_CONNECT_FAILED, NULL, event->connect.status, 0, NULL);
                 priam_found = false;
-                vTaskDelay(pdMS_TO_TICKS(3000));
-                ble_app_scan();
+                if (conn_via_cache) {
+                    // Cached peer not answering (off, or new random address): scan right away
+                    conn_via_cache = false;
+                    ble_app_scan();
+                } else {
+                    conn_schedule_retry(event->connect.status);
+                }
             }
             break;
         case BLE_GAP_EVENT_NOTIFY_RX: {
+            link_alive();
             uint16_t attr_handle = event->notify_rx.attr_handle;
             struct os_mbuf *om = event->notify_rx.om;
             uint8_t data[32];
@@ -508,59 +1854,63 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg) {
             if (len > 32) len = 32;
             os_mbuf_copydata(om, 0, len, data);
             
-            ESP_LOGI(TAG, "NOTIFY handle=%d len=%d: [%02X %02X %02X %02X %02X]",
+            DLOGD(LOG_BLE, 1000, "NOTIFY handle=%d len=%d: [%02X %02X %02X %02X %02X]",
                 attr_handle, len, data[0], len>1?data[1]:0, len>2?data[2]:0, len>3?data[3]:0, len>4?data[4]:0);
             
             if (attr_handle == status_val_handle && len >= 4) {
-                // Parse STATUS notification (same as on_status_read)
-                int voltage = data[3] * 2;  // decivolts
-                int percent = ((voltage - 315) * 100) / 65;
-                if (percent < 0) percent = 0;
-                if (percent > 100) percent = 100;
-                if (battery_percent != percent) {
-                    battery_percent = percent;
-                    ESP_LOGI(TAG, "Battery notify: %d%%", battery_percent);
+                int percent = status_battery_pct(data);
+                state_begin()->battery = percent;
+                if (state_end()) {
+                    DLOGI(LOG_BLE, 0, "Battery notify: %d%%", percent);
                     mqtt_publish_state();
                 }
             } else if (attr_handle == drive_mode_val_handle && len >= 1) {
                 // Parse DRIVE MODE notification
                 int mode = data[0];
-                if (mode >= 1 && mode <= 3 && drive_mode != mode) {
-                    drive_mode = mode;
-                    ESP_LOGI(TAG, "Mode notify: %d", drive_mode);
-                    mqtt_publish_state();
+                if (mode >= 1 && mode <= 3) {
+                    state_begin()->drive_mode = mode;
+                    if (state_end()) {
+                        DLOGI(LOG_BLE, 0, "Mode notify: %d", mode);
+                        mqtt_publish_state();
+                    }
                 }
             } else if (attr_handle == rocking_val_handle && len >= 3) {
                 // Parse ROCKING notification
                 // intensity = data[0] & 0xF, time_left = data[1] | (data[2] << 8)
                 int intensity = data[0] & 0x0F;
                 int time_left = data[1] | (data[2] << 8);
-                bool was_rocking = is_rocking;
-                is_rocking = (intensity > 0 || time_left > 0);
-                ESP_LOGI(TAG, "Rock notify: intensity=%d, time_left=%d", intensity, time_left);
-                if (is_rocking != was_rocking) mqtt_publish_state();
+                DLOGI(LOG_BLE, 10000, "Rock notify: intensity=%d, time_left=%d", intensity, time_left);
+                rock_session_notify(intensity > 0 || time_left > 0, time_left);
             }
             break;
         }
+        case BLE_GAP_EVENT_CONN_UPDATE:
+            if (event->conn_update.status == 0) {
+                connparam_updates++;
+            } else {
+                // RN4871 refused; we'll ask again on the next profile switch
+                connparam_rejects++;
+                connparam_requested = -1;
+                DLOGW(LOG_BLE, 0, "Conn update rejected: %d", event->conn_update.status);
+            }
+            connparam_refresh();
+            break;
         case BLE_GAP_EVENT_DISCONNECT:
-            ESP_LOGI(TAG, "DISCONNECT: reason=0x%04X", event->disconnect.reason);
-            web_log_add("Disconnected: 0x%04X", event->disconnect.reason);
-            conn_handle = BLE_HS_CONN_HANDLE_NONE;
-            ble_connected = false;
-            priam_found = false;
-            have_candidate = false;
-            chars_discovered = false;
-            battery_percent = -1;
-            battery_leds = -1;
-            drive_mode = -1;
-            is_rocking = false;
-            status_val_handle = 0;
-            drive_mode_val_handle = 0;
-            rocking_val_handle = 0;
-            battery_led_val_handle = 0;
-            mqtt_publish_state();  // Update HA immediately
-            vTaskDelay(pdMS_TO_TICKS(2000));
-            ble_app_scan();
+            DLOGI(LOG_BLE, 0, "DISCONNECT: reason=0x%04X", event->disconnect.reason);
+            ev_log(EV_DISCONNECTED, NULL, event->disconnect.reason, 0, NULL);
+            if (event->disconnect.conn.conn_handle == conn_dead_handle) {
+                // Already torn down by the supervisor; the address is free again
+                conn_dead_handle = BLE_HS_CONN_HANDLE_NONE;
+                if (conn_state == CONN_BACKOFF) conn_schedule(conn_last_reason, 0);
+                break;
+            }
+            if (event->disconnect.reason == BLE_HS_ERR_HCI_BASE + BLE_ERR_CONN_SPVN_TMO && link_quality >= 0) {
+                // Supervision timeout beat the supervisor
+                link_detect_ms = (int32_t)link_silence_ms();
+                link_dead_count++;
+            }
+            conn_teardown();
+            conn_schedule_retry(event->disconnect.reason);
             break;
         default:
             break;
@@ -568,28 +1918,50 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg) {
     return 0;
 }
 
-static void ble_app_scan(void) {
+// Start the next window of the current cycle; false once the cycle is over.
+// A window that fails to start schedules a retry instead.
+static bool scan_window_start(void) {
+    int left = scan_duration_ms - (int)((esp_timer_get_time() - scan_cycle_us) / 1000);
+    if (scan_window_no > 0 && left < scan_itvl_ms) return false;  // Not even one scan interval left
+    bool open = scan_cur_mode == SCAN_MODE_OPEN;
     struct ble_gap_disc_params dp = {
-        .itvl = 0,
-        .window = 0,
-        .filter_policy = BLE_HCI_SCAN_FILT_NO_WL,
+        .itvl = BLE_GAP_SCAN_ITVL_MS(scan_itvl_ms),
+        .window = BLE_GAP_SCAN_WIN_MS(scan_window_ms),
+        .filter_policy = scan_cur_wl ? BLE_HCI_SCAN_FILT_USE_WL : BLE_HCI_SCAN_FILT_NO_WL,
         .limited = 0,
-        .passive = 0,
-        .filter_duplicates = 0  // Allow duplicates to see repeated advertisements
+        .passive = !open && !scan_cur_wl && scan_window_no > 0,
+        .filter_duplicates = !open  // OPEN sees repeated advertisements
     };
+    int rc = ble_gap_disc(own_addr_type, open ? left : MIN(left, SCAN_DUP_RESET_MS), &dp, ble_gap_event, NULL);
+    scan_window_no++;
+    if (rc != 0) {
+        DLOGE(LOG_SCAN, 0, "Scan start failed: %d", rc);
+        ev_log(EV_SCAN_FAILED, NULL, rc, 0, NULL);
+        conn_schedule_retry(rc);
+        return true;
+    }
+    conn_set_state(CONN_SCANNING);
+    return true;
+}
+
+static void ble_app_scan(void) {
+    scan_cur_mode = scan_mode;
+    // Alternate whitelist cycles with open ones so a peer that rotated its
+    // random address is still found
+    scan_cur_wl = scan_cur_mode == SCAN_MODE_WL && peer_cache_valid && (scan_cycle_count % 2) == 0 &&
+        ble_gap_wl_set(&peer_cache.addr, 1) == 0;
     scan_cycle_count++;
     scan_device_count = 0;
     have_candidate = false;
-    ESP_LOGI(TAG, "Scan cycle #%d starting (30s)...", scan_cycle_count);
-    web_log_add("Scan #%d started...", scan_cycle_count);
+    ble_npl_callout_stop(&cand_timer);
+    DLOGI(LOG_SCAN, 0, "Scan cycle #%d starting (%s%s, %d/%d ms, %d ms)...", scan_cycle_count,
+        DLOG_STR(scan_mode_names[scan_cur_mode]), DLOG_STR(scan_cur_wl ? "+wl" : ""), scan_window_ms, scan_itvl_ms,
+        scan_duration_ms);
+    ev_log(EV_SCAN, NULL, scan_cycle_count, 0, NULL);
     priam_found = false;
-    int rc = ble_gap_disc(own_addr_type, 30000, &dp, ble_gap_event, NULL);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "Scan start failed: %d", rc);
-        web_log_add("Scan failed: %d", rc);
-        vTaskDelay(pdMS_TO_TICKS(5000));
-        ble_app_scan();
-    }
+    scan_cycle_us = esp_timer_get_time();
+    scan_window_no = 0;
+    scan_window_start();
 }
 
 static void ble_host_task(void *p) {
@@ -617,44 +1989,809 @@ static void ble_on_sync(void) {
             addr[5], addr[4], addr[3], addr[2], addr[1], addr[0], own_addr_type);
     }
     
-    ble_app_scan();
+    conn_start();
 }
 
 static void ble_on_reset(int r) {
     ESP_LOGE(TAG, "BLE reset: %d", r);
+    // Host resyncs and calls ble_on_sync, which starts a fresh scan
+    ble_npl_callout_stop(&conn_timer);
+    conn_set_state(CONN_IDLE);
 }
 
 static void ble_init(void) {
     if (nimble_port_init() != ESP_OK) return;
+    ble_npl_callout_init(&conn_timer, nimble_port_get_dflt_eventq(), conn_timer_cb, NULL);
+    ble_npl_callout_init(&cand_timer, nimble_port_get_dflt_eventq(), cand_timer_cb, NULL);
+    ble_npl_callout_init(&connparam_timer, nimble_port_get_dflt_eventq(), connparam_timer_cb, NULL);
+    ble_npl_callout_init(&link_timer, nimble_port_get_dflt_eventq(), link_timer_cb, NULL);
     ble_hs_cfg.sync_cb = ble_on_sync;
     ble_hs_cfg.reset_cb = ble_on_reset;
     ble_svc_gap_device_name_set("EPriam-Bridge");
     nimble_port_freertos_init(ble_host_task);
 }
 
-// Auto-renew task - runs every minute to check if rocking needs renewal
-static void auto_renew_task(void *arg) {
+// Rocking sessions
+// The stroller runs timed segments of at most ROCK_SEGMENT_MAX_MIN minutes.
+// Longer and auto-renew sessions are a chain of segments: a one-shot esp_timer
+// fires ROCK_RENEW_LEAD_S before the running segment ends and starts the next
+// one, so the stroller never stops in between. No session, no timer and no
+// wakeups.
+//
+// Remaining time comes from the stroller: each ROCKING notification carries
+// time_left, and between them we count down from the last report
+// (state.time_left_s at state.time_left_us). The anchor only moves when a
+// report disagrees by more than ROCK_LEFT_SLACK_S, so the state version and
+// MQTT stay quiet while the countdown runs on schedule. MQTT is refreshed on
+// minute boundaries by a second one-shot timer, and at once on corrections of
+// ROCK_LEFT_PUBLISH_S or more.
+#define ROCK_SEGMENT_MAX_MIN 30
+#define ROCK_SESSION_MAX_MIN 180
+#define ROCK_RENEW_LEAD_S 15    // Room for the write to reach the stroller
+#define ROCK_REARM_SLACK_US 2000000  // Ignore notify jitter smaller than this
+#define ROCK_SETTLE_S 5         // Notifies this soon after a start may predate it
+#define ROCK_LEFT_SLACK_S 2     // Report vs countdown difference still on schedule
+#define ROCK_LEFT_PUBLISH_S 10  // Correction worth publishing before the next minute
+
+static esp_timer_handle_t rock_timer = NULL;
+static esp_timer_handle_t rock_tick_timer = NULL;
+static SemaphoreHandle_t rock_lock = NULL;
+static int64_t rock_due_us = 0;       // Armed renewal, 0 = disarmed
+static volatile uint32_t rock_renewals = 0;
+static volatile uint32_t rock_corrections = 0;
+static volatile int rock_left_published = 0;  // MQTT remaining: only moved by the minute tick and corrections
+
+// Microseconds the running segment has left: the stroller's last report
+// counted down, or our own start time until the first report arrives
+static int64_t rock_segment_left_us(const bridge_state_t *s, int64_t now_us) {
+    int64_t end_us;
+    if (s->time_left_us / 1000000 >= s->rock_start_s) end_us = s->time_left_us + (int64_t)s->time_left_s * 1000000;
+    else end_us = (s->rock_start_s + s->rock_minutes * 60) * 1000000LL;
+    return end_us > now_us ? end_us - now_us : 0;
+}
+
+static int rock_segment_left(const bridge_state_t *s, int64_t now_us) {
+    return (int)((rock_segment_left_us(s, now_us) + 500000) / 1000000);
+}
+
+// Whole session: the running segment, or the session deadline if later segments follow
+static int64_t rock_left_us(const bridge_state_t *s, int64_t now_us) {
+    int64_t left = rock_segment_left_us(s, now_us);
+    if (s->session && s->session_end_s) left = MAX(left, s->session_end_s * 1000000 - now_us);
+    return left;
+}
+
+// Seconds left of the current rocking session (0 when stopped or continuous).
+// The one value /api/status, SSE, MQTT and the web UI all show.
+static int rock_remaining_sec(const bridge_state_t *s) {
+    if (!s->rocking) return 0;
+    return (int)((rock_left_us(s, esp_timer_get_time()) + 500000) / 1000000);
+}
+
+// Minutes for the segment after this one, 0 = the running one finishes the session
+static int rock_next_segment(const bridge_state_t *s, int64_t now_us, int left) {
+    if (!s->session) return 0;
+    if (!s->session_end_s) return ROCK_SEGMENT_MAX_MIN;
+    int64_t total = s->session_end_s - now_us / 1000000;
+    if (total <= left) return 0;
+    return (int)MIN((total + 59) / 60, ROCK_SEGMENT_MAX_MIN);
+}
+
+// Arm the renewal and the minute tick from what we know now, or disarm them
+static void rock_replan(void) {
+    if (!rock_timer) return;
+    bridge_state_t st;
+    state_get(&st);
+    int64_t now = esp_timer_get_time();
+    int left = rock_segment_left(&st, now);
+    xSemaphoreTake(rock_lock, portMAX_DELAY);
+    if (!rock_next_segment(&st, now, left)) {
+        if (rock_due_us) esp_timer_stop(rock_timer);
+        rock_due_us = 0;
+    } else {
+        int64_t due = now + (int64_t)MAX(left - ROCK_RENEW_LEAD_S, 0) * 1000000;
+        if (!rock_due_us || llabs(due - rock_due_us) > ROCK_REARM_SLACK_US) {
+            if (rock_due_us) esp_timer_stop(rock_timer);
+            esp_timer_start_once(rock_timer, due - now);
+            rock_due_us = due;
+        }
+    }
+    // Next time the countdown crosses a whole minute; a start is not acked yet
+    esp_timer_stop(rock_tick_timer);
+    int64_t total = rock_left_us(&st, now);
+    if (total > 0 && (st.rocking || now / 1000000 - st.rock_start_s <= ROCK_SETTLE_S)) {
+        int64_t phase = total % 60000000;
+        esp_timer_start_once(rock_tick_timer, phase ? phase : 60000000);
+    }
+    xSemaphoreGive(rock_lock);
+}
+
+// Take the countdown for MQTT and publish it
+static void rock_publish_left(void) {
+    bridge_state_t st;
+    state_get(&st);
+    rock_left_published = rock_remaining_sec(&st);
+    mqtt_publish_state();
+}
+
+static void rock_tick_cb(void *arg) {
+    rock_publish_left();
+    rock_replan();
+}
+
+static void rock_timer_cb(void *arg) {
+    int64_t now = esp_timer_get_time();
+    bridge_state_t st;
+    state_get(&st);
+    int left = rock_segment_left(&st, now);
+    int seg = rock_next_segment(&st, now, left);
+    xSemaphoreTake(rock_lock, portMAX_DELAY);
+    rock_due_us = 0;
+    xSemaphoreGive(rock_lock);
+    if (!seg) return;
+
+    bridge_state_t *s = state_begin();
+    s->rock_minutes = seg;
+    s->rock_start_s = now / 1000000;
+    s->time_left_us = 0;  // Reports from here on belong to the new segment
+    state_end();
+    rock_renewals++;
+    ev_log(EV_ROCK_RENEW, NULL, seg, left, NULL);
+    ble_cmd_rock_start();  // Queued; waits for the link if it is down
+    rock_replan();         // Fallback deadline until the first notify of the new segment
+    mqtt_publish_state();
+}
+
+// Start rocking for minutes (0 = continuous), chaining segments if it is
+// longer than the stroller allows or auto_renew is set
+static uint32_t rock_session_start(int minutes) {
+    int64_t now = esp_timer_get_time() / 1000000;
+    bridge_state_t *s = state_begin();
+    s->session = s->auto_renew || minutes > ROCK_SEGMENT_MAX_MIN;
+    s->session_end_s = s->session && !s->auto_renew ? now + minutes * 60 : 0;
+    s->rock_minutes = s->auto_renew ? ROCK_SEGMENT_MAX_MIN : MIN(minutes, ROCK_SEGMENT_MAX_MIN);
+    s->rock_start_s = now;
+    s->time_left_us = 0;
+    state_end();
+    uint32_t id = ble_cmd_rock_start();
+    rock_replan();
+    return id;
+}
+
+static uint32_t rock_session_stop(void) {
+    bridge_state_t *s = state_begin();
+    s->session = false;
+    s->auto_renew = false;
+    state_end();
+    rock_replan();
+    return ble_cmd_rock_stop();
+}
+
+// ROCKING notification (host task): follow the stroller's countdown
+static void rock_session_notify(bool rocking, int time_left) {
+    int64_t now = esp_timer_get_time();
+    bridge_state_t *s = state_begin();
+    bool was_rocking = s->rocking;
+    int drift = abs(time_left - rock_segment_left(s, now));
+    // Until this segment's first report, one sent before the start (the old
+    // segment's countdown, or idle) can still arrive; inside the settle window
+    // only a time_left that fits the new segment becomes the anchor
+    bool first = s->time_left_us / 1000000 < s->rock_start_s;
+    bool stale = first && now / 1000000 - s->rock_start_s <= ROCK_SETTLE_S && drift > ROCK_SETTLE_S;
+    bool anchor = !stale && (first || drift > ROCK_LEFT_SLACK_S);
+    bool ended = !rocking && s->session && now / 1000000 - s->rock_start_s > ROCK_SETTLE_S;
+    bool done = ended && s->session_end_s && now / 1000000 >= s->session_end_s - ROCK_SETTLE_S;
+    if (ended) {
+        // Last segment ran out, stopped on the stroller, or a renewal never made it
+        s->session = false;
+        s->auto_renew = false;
+    }
+    s->rocking = rocking;
+    if (anchor) {
+        s->time_left_s = time_left;
+        s->time_left_us = now;
+    }
+    bool changed = state_end();
+    if (ended) ev_log(EV_ROCK_END, done ? "done" : "stopped on stroller", 0, 0, NULL);
+    if (!changed) return;
+    if (anchor && drift > ROCK_LEFT_SLACK_S) rock_corrections++;
+    rock_replan();
+    if (rocking != was_rocking || (anchor && drift >= ROCK_LEFT_PUBLISH_S)) rock_publish_left();
+}
+
+static void rock_session_init(void) {
+    rock_lock = xSemaphoreCreateMutex();
+    esp_timer_create_args_t args = {.callback = rock_timer_cb, .name = "rock"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &rock_timer));
+    args = (esp_timer_create_args_t){.callback = rock_tick_cb, .name = "rock_tick"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &rock_tick_timer));
+}
+
+// Session recovery
+// A reboot (OTA, crash, watchdog) must not end a session: nothing would renew
+// the running segment and the stroller stops at its timeout. Every state
+// change copies the session into RTC memory that survives a reset, with the
+// deadline on the RTC clock, which keeps counting through it. Flash gets a copy
+// only when what to resume changes, for power loss: session_nvs_timer writes it
+// after SESSION_NVS_DELAY_MS, or right away for a stop, so no caller of
+// state_end() waits on flash. On boot session_restore() re-issues the
+// session before WiFi is up; from flash only open-ended (auto-renew) sessions
+// resume, since the outage length is unknown.
+#define SESSION_SAVE_VERSION 1
+#define SESSION_NVS_DELAY_MS 60000
+
+typedef struct {
+    uint8_t version;
+    bool active;            // The session engine owned a session
+    bool auto_renew;
+    uint8_t intensity;
+    int8_t drive_mode;
+    int64_t end_rtc_us;     // esp_rtc_get_time_us() the session ends, 0 = open-ended
+    int64_t saved_rtc_us;
+    uint32_t check;         // fnv1a over the fields above
+} session_save_t;
+
+static RTC_NOINIT_ATTR session_save_t session_rtc;
+static session_save_t session_nvs;     // Last written to (or read from) flash, under session_mux
+static portMUX_TYPE session_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t session_nvs_timer = NULL;
+static volatile uint32_t session_resume_id = 0;
+static const char *session_restored_from = "none";
+static int32_t session_offline_ms = -1;   // Last save to restore
+static int32_t session_recover_ms = -1;   // Boot to the re-issued start being acked
+static volatile uint32_t session_nvs_writes = 0;
+
+static uint32_t session_check(const session_save_t *r) {
+    return fnv1a(r, offsetof(session_save_t, check), FNV1A_INIT);
+}
+
+static bool session_same_intent(const session_save_t *a, const session_save_t *b) {
+    return a->active == b->active && a->auto_renew == b->auto_renew &&
+           a->intensity == b->intensity && a->drive_mode == b->drive_mode;
+}
+
+// esp_timer task only: flash writes stall the caller for milliseconds
+static void session_nvs_write(void *arg) {
+    session_save_t r, w;
+    portENTER_CRITICAL(&session_mux);
+    r = session_rtc;
+    w = session_nvs;
+    portEXIT_CRITICAL(&session_mux);
+    if (session_same_intent(&r, &w)) return;
+    nvs_handle_t nvs;
+    if (nvs_open("epriam", NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_blob(nvs, "session", &r, sizeof(r));
+        nvs_commit(nvs);
+        nvs_close(nvs);
+        portENTER_CRITICAL(&session_mux);
+        session_nvs = r;
+        portEXIT_CRITICAL(&session_mux);
+        session_nvs_writes++;
+    }
+}
+
+// Called after every state change and on esp_restart()
+static void session_save(void) {
+    if (!session_nvs_timer) return;  // Not restored yet; keep the old record
+    bridge_state_t st;
+    state_get(&st);
+    int64_t rtc = esp_rtc_get_time_us();
+    session_save_t r;
+    memset(&r, 0, sizeof(r));  // Padding is part of the check
+    r.version = SESSION_SAVE_VERSION;
+    r.active = st.session;
+    r.auto_renew = st.auto_renew;
+    r.intensity = st.intensity;
+    r.drive_mode = st.drive_mode;
+    if (st.session && st.session_end_s) r.end_rtc_us = rtc + rock_left_us(&st, esp_timer_get_time());
+    r.saved_rtc_us = rtc;
+    r.check = session_check(&r);
+    session_save_t w;
+    portENTER_CRITICAL(&session_mux);
+    session_rtc = r;
+    w = session_nvs;
+    portEXIT_CRITICAL(&session_mux);
+
+    if (session_same_intent(&r, &w)) return;
+    if (!r.active && w.active) {
+        // Never resume a session that was stopped: write as soon as the timer task runs
+        esp_timer_stop(session_nvs_timer);
+        esp_timer_start_once(session_nvs_timer, 0);
+    } else if (!esp_timer_is_active(session_nvs_timer)) {
+        esp_timer_start_once(session_nvs_timer, SESSION_NVS_DELAY_MS * 1000LL);
+    }
+}
+
+// Start-ack of the re-issued session (command executor)
+static void session_acked(uint32_t id) {
+    if (!id || id != session_resume_id) return;
+    session_resume_id = 0;
+    session_recover_ms = (int32_t)(esp_timer_get_time() / 1000);
+    ev_log(EV_SESSION_RESUMED, NULL, session_recover_ms, 0, NULL);
+}
+
+// After rock_session_init() and ble_cmd_init(), before ble_init()
+static void session_restore(void) {
+    session_save_t r = session_rtc;
+    int64_t rtc = esp_rtc_get_time_us();
+    bool from_rtc = r.version == SESSION_SAVE_VERSION && r.check == session_check(&r) && r.saved_rtc_us <= rtc;
+
+    nvs_handle_t nvs;
+    if (nvs_open("epriam", NVS_READONLY, &nvs) == ESP_OK) {
+        size_t len = sizeof(session_nvs);
+        if (nvs_get_blob(nvs, "session", &session_nvs, &len) != ESP_OK || len != sizeof(session_nvs) ||
+            session_nvs.version != SESSION_SAVE_VERSION || session_nvs.check != session_check(&session_nvs)) {
+            memset(&session_nvs, 0, sizeof(session_nvs));
+        }
+        nvs_close(nvs);
+    }
+    if (!from_rtc) {
+        r = session_nvs;
+        if (r.end_rtc_us) r.active = false;  // A timed session: can't tell how much is left
+    }
+
+    const esp_timer_create_args_t args = {.callback = session_nvs_write, .name = "session_nvs"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &session_nvs_timer));
+    esp_register_shutdown_handler(session_save);
+    if (r.version != SESSION_SAVE_VERSION) return;
+
+    int left = r.end_rtc_us ? (int)((r.end_rtc_us - rtc) / 1000000) : 0;
+    bridge_state_t *s = state_begin();
+    s->intensity = r.intensity;
+    s->drive_mode = r.drive_mode;  // Until the stroller reports it
+    s->auto_renew = r.active && r.auto_renew;
+    state_end();
+    if (!r.active || (r.end_rtc_us && left <= 0)) return;
+
+    session_restored_from = from_rtc ? "rtc" : "nvs";
+    session_offline_ms = from_rtc ? (int32_t)((rtc - r.saved_rtc_us) / 1000) : -1;
+    ev_log(EV_SESSION_RESTORED, session_restored_from, left, session_offline_ms, NULL);
+    ESP_LOGI(TAG, "Restoring %s session from %s (%d s left)", r.auto_renew ? "auto-renew" : "timed",
+             session_restored_from, left);
+    session_resume_id = rock_session_start(r.auto_renew ? ROCK_SEGMENT_MAX_MIN : (left + 59) / 60);
+    if (!r.auto_renew) {
+        // Keep the original deadline rather than a whole number of minutes from
+        // now; a single segment's worth left still belongs to the session
+        s = state_begin();
+        s->session = true;
+        s->session_end_s = esp_timer_get_time() / 1000000 + left;
+        state_end();
+        rock_replan();
+    }
+}
+
+typedef enum {
+    ENT_BATTERY, ENT_ROCKING, ENT_AUTORENEW, ENT_MODE, ENT_DURATION,
+    ENT_INTENSITY, ENT_CONNECTED, ENT_LINK, ENT_REMAINING, ENT_IP, ENT_COUNT
+} mqtt_entity_t;
+
+#define MQTT_VAL_LEN 16
+#define MQTT_TOPIC_LEN 64
+
+// MQTT entity registry
+// One row per Home Assistant entity. Discovery, state rendering and command
+// dispatch are all driven from this table; topics are built once at init.
+typedef struct {
+    const char *key;        // Object id suffix (epriam_<key>) and JSON state key
+    const char *platform;   // HA component
+    const char *name;       // Display name; points into the name_* buffers for editable ones
+    const char *extra;      // Entity-specific discovery fields
+    bool numeric;           // Unquoted in the JSON state document
+    void (*encode)(const bridge_state_t *s, char *v);  // Writes up to MQTT_VAL_LEN; "" = unknown
+    void (*command)(const char *payload);   // NULL = read-only
+} mqtt_entity_desc_t;
+
+static const char *const mqtt_mode_options[] = {"ECO", "TOUR", "BOOST"};  // drive_mode 1..3
+
+static const struct { int minutes; const char *label; } mqtt_duration_options[] = {
+    {30, "30 min"}, {60, "1 hour"}, {90, "1.5 hours"}, {120, "2 hours"}, {150, "2.5 hours"}, {180, "3 hours"},
+};
+
+static void enc_battery(const bridge_state_t *s, char *v) {
+    if (s->battery >= 0) snprintf(v, MQTT_VAL_LEN, "%d", s->battery);
+}
+
+static void enc_rocking(const bridge_state_t *s, char *v) { strcpy(v, s->rocking ? "ON" : "OFF"); }
+static void enc_autorenew(const bridge_state_t *s, char *v) { strcpy(v, s->auto_renew ? "ON" : "OFF"); }
+static void enc_connected(const bridge_state_t *s, char *v) { strcpy(v, ble_connected ? "ON" : "OFF"); }
+static void enc_intensity(const bridge_state_t *s, char *v) { snprintf(v, MQTT_VAL_LEN, "%d", s->intensity); }
+static void enc_ip(const bridge_state_t *s, char *v) { memcpy(v, ip_str, sizeof(ip_str)); }
+
+static void enc_mode(const bridge_state_t *s, char *v) {
+    strcpy(v, s->drive_mode >= 1 && s->drive_mode <= 3 ? mqtt_mode_options[s->drive_mode - 1] : "UNKNOWN");
+}
+
+static void enc_duration(const bridge_state_t *s, char *v) {
+    strcpy(v, "2 hours");
+    for (int i = 0; i < sizeof(mqtt_duration_options) / sizeof(mqtt_duration_options[0]); i++) {
+        if (mqtt_duration_options[i].minutes == s->auto_renew_duration) strcpy(v, mqtt_duration_options[i].label);
+    }
+}
+
+static void enc_link(const bridge_state_t *s, char *v) {
+    if (link_quality_published >= 0) snprintf(v, MQTT_VAL_LEN, "%d", link_quality_published);
+}
+
+// Not rock_remaining_sec(): any other publish would carry a fresh countdown
+static void enc_remaining(const bridge_state_t *s, char *v) {
+    snprintf(v, MQTT_VAL_LEN, "%d", s->rocking ? rock_left_published : 0);
+}
+
+static void cmd_rocking(const char *payload) {
+    if (strcmp(payload, "ON") == 0) {
+        bridge_state_t st;
+        state_get(&st);
+        rock_session_start(st.auto_renew_duration);
+    } else {
+        rock_session_stop();
+    }
+    mqtt_publish_state();
+}
+
+static void cmd_mode(const char *payload) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(payload, mqtt_mode_options[i]) == 0) ble_cmd_set_mode(i + 1);
+    }
+}
+
+static void cmd_autorenew(const char *payload) {
+    bool on = strcmp(payload, "ON") == 0;
+    bridge_state_t *s = state_begin();
+    s->auto_renew = on;
+    // Turning it on adopts a running session; off lets the current segment finish
+    if (on) {
+        s->session = s->rocking;
+        s->session_end_s = 0;
+    } else if (!s->session_end_s) {
+        s->session = false;
+    }
+    state_end();
+    rock_replan();
+    ESP_LOGI(TAG, "Auto-renew: %s", on ? "ON" : "OFF");
+    mqtt_publish_state();
+}
+
+static void cmd_intensity(const char *payload) {
+    int i = atoi(payload);
+    if (i >= 0 && i <= 100) {
+        state_begin()->intensity = i;
+        state_end();
+    }
+    mqtt_publish_state();
+}
+
+static void cmd_duration(const char *payload) {
+    for (int i = 0; i < sizeof(mqtt_duration_options) / sizeof(mqtt_duration_options[0]); i++) {
+        if (strcmp(payload, mqtt_duration_options[i].label) == 0) {
+            state_begin()->auto_renew_duration = mqtt_duration_options[i].minutes;
+            state_end();
+            ESP_LOGI(TAG, "Duration set to %d min", mqtt_duration_options[i].minutes);
+        }
+    }
+    mqtt_publish_state();
+}
+
+static const mqtt_entity_desc_t mqtt_entities[ENT_COUNT] = {
+    [ENT_BATTERY] = {"battery", "sensor", name_battery,
+        "\"device_class\":\"battery\",\"state_class\":\"measurement\",\"unit_of_measurement\":\"%\"",
+        true, enc_battery, NULL},
+    [ENT_ROCKING] = {"rocking", "switch", name_rocking, "\"icon\":\"mdi:baby-carriage\"",
+        false, enc_rocking, cmd_rocking},
+    [ENT_AUTORENEW] = {"autorenew", "switch", name_autorenew, "\"icon\":\"mdi:autorenew\"",
+        false, enc_autorenew, cmd_autorenew},
+    [ENT_MODE] = {"mode", "select", name_mode,
+        "\"options\":[\"ECO\",\"TOUR\",\"BOOST\"],\"icon\":\"mdi:speedometer\"",
+        false, enc_mode, cmd_mode},
+    [ENT_DURATION] = {"duration", "select", "Duration",
+        "\"options\":[\"30 min\",\"1 hour\",\"1.5 hours\",\"2 hours\",\"2.5 hours\",\"3 hours\"],"
+        "\"icon\":\"mdi:timer-outline\"",
+        false, enc_duration, cmd_duration},
+    [ENT_INTENSITY] = {"intensity", "number", name_intensity,
+        "\"min\":0,\"max\":100,\"step\":10,\"icon\":\"mdi:vibrate\"",
+        true, enc_intensity, cmd_intensity},
+    [ENT_CONNECTED] = {"connected", "binary_sensor", name_connected,
+        "\"payload_on\":\"ON\",\"payload_off\":\"OFF\",\"device_class\":\"connectivity\"",
+        false, enc_connected, NULL},
+    [ENT_LINK] = {"link", "sensor", "Signalkvalitet",
+        "\"unit_of_measurement\":\"%\",\"state_class\":\"measurement\",\"icon\":\"mdi:signal\","
+        "\"entity_category\":\"diagnostic\"",
+        true, enc_link, NULL},
+    [ENT_REMAINING] = {"remaining", "sensor", "Gjenstående tid",
+        "\"unit_of_measurement\":\"s\",\"icon\":\"mdi:timer-outline\"",
+        true, enc_remaining, NULL},
+    [ENT_IP] = {"ip", "sensor", "IP-adresse", "\"icon\":\"mdi:ip-network\"",
+        false, enc_ip, NULL},
+};
+
+// homeassistant/<platform>/epriam_<key>/{state,set,config}, filled by mqtt_topics_init()
+static char mqtt_topic_state[ENT_COUNT][MQTT_TOPIC_LEN];
+static char mqtt_topic_cmd[ENT_COUNT][MQTT_TOPIC_LEN];
+static char mqtt_topic_config[ENT_COUNT][MQTT_TOPIC_LEN];
+
+// Incoming topic -> entity: open-addressed on FNV-1a of the topic, confirmed
+// by length and one memcmp. Holds the command topics, HA's birth topic and
+// the log level topic ("debug" for every subsystem, or e.g. "ble=debug").
+#define MQTT_HA_STATUS_TOPIC "homeassistant/status"
+#define MQTT_LOG_LEVEL_TOPIC "epriam/log_level/set"
+#define MQTT_TOPIC_HA_STATUS ENT_COUNT
+#define MQTT_TOPIC_LOG_LEVEL (ENT_COUNT + 1)
+#define MQTT_DISPATCH_SLOTS 16  // Power of two, well above the topic count
+
+typedef struct {
+    uint32_t hash;
+    uint8_t len;
+    int8_t ent;  // -1 = empty
+} mqtt_dispatch_t;
+
+static mqtt_dispatch_t mqtt_dispatch[MQTT_DISPATCH_SLOTS];
+
+static const char *mqtt_dispatch_topic(int ent) {
+    if (ent == MQTT_TOPIC_HA_STATUS) return MQTT_HA_STATUS_TOPIC;
+    if (ent == MQTT_TOPIC_LOG_LEVEL) return MQTT_LOG_LEVEL_TOPIC;
+    return mqtt_topic_cmd[ent];
+}
+
+static void mqtt_dispatch_add(int ent) {
+    const char *t = mqtt_dispatch_topic(ent);
+    uint32_t h = fnv1a(t, strlen(t), FNV1A_INIT);
+    uint32_t i = h & (MQTT_DISPATCH_SLOTS - 1);
+    while (mqtt_dispatch[i].ent >= 0) i = (i + 1) & (MQTT_DISPATCH_SLOTS - 1);
+    mqtt_dispatch[i] = (mqtt_dispatch_t){.hash = h, .len = strlen(t), .ent = ent};
+}
+
+// Entity for an incoming topic (not NUL-terminated), or -1
+static int mqtt_dispatch_find(const char *topic, int len) {
+    uint32_t h = fnv1a(topic, len, FNV1A_INIT);
+    uint32_t i = h & (MQTT_DISPATCH_SLOTS - 1);
+    for (int n = 0; n < MQTT_DISPATCH_SLOTS && mqtt_dispatch[i].ent >= 0; n++) {
+        const mqtt_dispatch_t *d = &mqtt_dispatch[i];
+        if (d->hash == h && d->len == len && memcmp(mqtt_dispatch_topic(d->ent), topic, len) == 0) return d->ent;
+        i = (i + 1) & (MQTT_DISPATCH_SLOTS - 1);
+    }
+    return -1;
+}
+
+static void mqtt_topics_init(void) {
+    for (int i = 0; i < MQTT_DISPATCH_SLOTS; i++) mqtt_dispatch[i].ent = -1;
+    for (int i = 0; i < ENT_COUNT; i++) {
+        const mqtt_entity_desc_t *d = &mqtt_entities[i];
+        snprintf(mqtt_topic_state[i], MQTT_TOPIC_LEN, "homeassistant/%s/epriam_%s/state", d->platform, d->key);
+        snprintf(mqtt_topic_cmd[i], MQTT_TOPIC_LEN, "homeassistant/%s/epriam_%s/set", d->platform, d->key);
+        snprintf(mqtt_topic_config[i], MQTT_TOPIC_LEN, "homeassistant/%s/epriam_%s/config", d->platform, d->key);
+        if (d->command) mqtt_dispatch_add(i);
+    }
+    mqtt_dispatch_add(MQTT_TOPIC_HA_STATUS);
+    mqtt_dispatch_add(MQTT_TOPIC_LOG_LEVEL);
+}
+
+// MQTT state publisher
+// mqtt_publish_state() only wakes the publisher task, so it is cheap enough to
+// call from the NimBLE host task and HTTP/MQTT handlers. The task waits
+// MQTT_PUB_COALESCE_MS for the burst to settle, renders every entity once and
+// publishes only those that differ from what the broker already has.
+#define MQTT_PUB_COALESCE_MS 250
+#define MQTT_JSON_STATE_TOPIC "epriam/state"
+static char mqtt_shadow[ENT_COUNT][MQTT_VAL_LEN];  // Last value published; publisher task only
+static volatile uint32_t mqtt_pub_sent = 0;
+static volatile uint32_t mqtt_pub_suppressed = 0;
+static TaskHandle_t mqtt_pub_handle = NULL;
+
+// Called after every state change; also wakes the web UI push channel
+static void mqtt_publish_state(void) {
+    if (mqtt_pub_handle) xTaskNotifyGive(mqtt_pub_handle);
+    sse_notify();
+}
+
+// Whole state as one document: {"battery":69,"rocking":"ON",...}
+static int mqtt_render_json(char *out, size_t len, char v[ENT_COUNT][MQTT_VAL_LEN]) {
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, out, len);
+    jw_obj(&j, NULL);
+    for (int i = 0; i < ENT_COUNT; i++) {
+        const mqtt_entity_desc_t *d = &mqtt_entities[i];
+        if (!v[i][0]) jw_null(&j, d->key);
+        else if (d->numeric) jw_value(&j, d->key, v[i]);
+        else jw_str(&j, d->key, v[i]);
+    }
+    jw_obj_end(&j);
+    return json_buf_ok(&b) ? b.len : -1;
+}
+
+// Current value of every entity; "" = unknown, not published
+static void mqtt_render_state(char v[ENT_COUNT][MQTT_VAL_LEN]) {
+    bridge_state_t st;
+    state_get(&st);
+    memset(v, 0, ENT_COUNT * MQTT_VAL_LEN);  // Zero padding keeps the memcmp in mqtt_pub_task exact
+    for (int i = 0; i < ENT_COUNT; i++) mqtt_entities[i].encode(&st, v[i]);
+}
+
+static void mqtt_pub_task(void *arg) {
+    static char v[ENT_COUNT][MQTT_VAL_LEN];
     while (1) {
-        vTaskDelay(pdMS_TO_TICKS(60000));  // Check every minute
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(MQTT_PUB_COALESCE_MS));
+        ulTaskNotifyTake(pdTRUE, 0);  // Fold in wakeups from the same burst
+        if (!mqtt_connected) continue;
+        if (mqtt_shadow_stale) {
+            mqtt_shadow_stale = false;
+            memset(mqtt_shadow, 0, sizeof(mqtt_shadow));
+        }
+        mqtt_render_state(v);
+        if (mqtt_json_state) {
+            if (memcmp(v, mqtt_shadow, sizeof(mqtt_shadow)) == 0) {
+                mqtt_pub_suppressed++;
+                continue;
+            }
+            char doc[320];
+            int len = mqtt_render_json(doc, sizeof(doc), v);
+            if (len > 0 && esp_mqtt_client_publish(mqtt_client, MQTT_JSON_STATE_TOPIC, doc, len, mqtt_persistent, true) >= 0) {
+                memcpy(mqtt_shadow, v, sizeof(mqtt_shadow));
+                mqtt_pub_sent++;
+                if (mqtt_connect_to_state_ms < 0) {
+                    mqtt_connect_to_state_ms = (int32_t)((esp_timer_get_time() - mqtt_connected_us) / 1000);
+                }
+            } else {
+                mqtt_shadow_stale = true;
+            }
+            continue;
+        }
+        for (int i = 0; i < ENT_COUNT; i++) {
+            if (!v[i][0] || strcmp(v[i], mqtt_shadow[i]) == 0) {
+                mqtt_pub_suppressed++;
+                continue;
+            }
+            if (esp_mqtt_client_publish(mqtt_client, mqtt_topic_state[i], v[i], 0, mqtt_persistent, true) < 0) {
+                mqtt_shadow_stale = true;  // Retry everything on the next wakeup
+                continue;
+            }
+            memcpy(mqtt_shadow[i], v[i], MQTT_VAL_LEN);
+            mqtt_pub_sent++;
+        }
+        if (mqtt_connect_to_state_ms < 0) {
+            mqtt_connect_to_state_ms = (int32_t)((esp_timer_get_time() - mqtt_connected_us) / 1000);
+        }
+    }
+}
+
+// Home Assistant discovery
+// Either one retained config per entity (homeassistant/<platform>/epriam_<key>/config)
+// or a single device payload with a "components" map. A hash of what was last
+// published is kept in NVS; when the broker reconnects and nothing changed the
+// retained copies are still there, so nothing is sent.
+#define MQTT_DEVICE_DISCOVERY_TOPIC "homeassistant/device/epriam/config"
+#define MQTT_DISCOVERY_MAX 3072
+
+// Discovery fields of one entity, without braces or the device block
+static void mqtt_discovery_component(json_writer_t *j, mqtt_entity_t e) {
+    const mqtt_entity_desc_t *d = &mqtt_entities[e];
+    char uid[24];
+    snprintf(uid, sizeof(uid), "epriam_%s", d->key);
+    jw_str(j, "name", d->name);
+    jw_str(j, "unique_id", uid);
+    if (mqtt_json_state) {
+        char tpl[40];
+        snprintf(tpl, sizeof(tpl), "{{ value_json.%s }}", d->key);
+        jw_str(j, "state_topic", MQTT_JSON_STATE_TOPIC);
+        jw_str(j, "value_template", tpl);
+    } else {
+        jw_str(j, "state_topic", mqtt_topic_state[e]);
+    }
+    jw_str(j, "availability_topic", MQTT_AVAIL_TOPIC);
+    if (d->command) jw_str(j, "command_topic", mqtt_topic_cmd[e]);
+    jw_members(j, d->extra);
+}
+
+static void mqtt_device_block(json_writer_t *j) {
+    jw_obj(j, "device");
+    jw_arr(j, "identifiers");
+    jw_str(j, NULL, "epriam");
+    jw_arr_end(j);
+    jw_str(j, "name", name_device);
+    jw_str(j, "manufacturer", "Cybex");
+    jw_obj_end(j);
+}
+
+// Render every payload; publish only if the content hash differs from NVS (or force)
+static void mqtt_publish_discovery(bool force) {
+    if (!mqtt_connected) return;
+    
+    char *buf = malloc(MQTT_DISCOVERY_MAX);
+    if (!buf) return;
+    
+    // Same rendering for hashing and publishing; publish on the second pass.
+    // QoS 1, and the hash is only stored once every publish was accepted, so a
+    // config lost on a bad link goes out again on the next connect.
+    uint32_t hash = 0;
+    bool sent = true;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t h = fnv1a(&mqtt_device_discovery, sizeof(mqtt_device_discovery), FNV1A_INIT);
+        json_buf_t b;
+        json_writer_t j;
+        bool ok = true;
+        if (mqtt_device_discovery) {
+            jw_init_buf(&j, &b, buf, MQTT_DISCOVERY_MAX);
+            jw_obj(&j, NULL);
+            mqtt_device_block(&j);
+            jw_obj(&j, "origin");
+            jw_str(&j, "name", "esPriam32");
+            jw_obj_end(&j);
+            jw_obj(&j, "components");
+            for (int i = 0; i < ENT_COUNT; i++) {
+                char uid[24];
+                snprintf(uid, sizeof(uid), "epriam_%s", mqtt_entities[i].key);
+                jw_obj(&j, uid);
+                jw_str(&j, "platform", mqtt_entities[i].platform);
+                mqtt_discovery_component(&j, i);
+                jw_obj_end(&j);
+            }
+            jw_obj_end(&j);
+            jw_obj_end(&j);
+            ok = json_buf_ok(&b);
+            h = fnv1a(buf, b.len, h);
+            if (pass && ok && esp_mqtt_client_publish(mqtt_client, MQTT_DEVICE_DISCOVERY_TOPIC, buf, b.len, 1, true) < 0) {
+                sent = false;
+            }
+        } else {
+            for (int i = 0; i < ENT_COUNT && ok; i++) {
+                jw_init_buf(&j, &b, buf, MQTT_DISCOVERY_MAX);
+                jw_obj(&j, NULL);
+                mqtt_discovery_component(&j, i);
+                mqtt_device_block(&j);
+                jw_obj_end(&j);
+                ok = json_buf_ok(&b);
+                h = fnv1a(buf, b.len, h);
+                if (pass && ok && esp_mqtt_client_publish(mqtt_client, mqtt_topic_config[i], buf, b.len, 1, true) < 0) {
+                    sent = false;
+                }
+            }
+        }
+        if (!ok) {
+            ESP_LOGE(TAG, "Discovery payload too large (%d)", b.len);
+            free(buf);
+            return;
+        }
+        if (pass) break;
+        hash = h;
         
-        if (auto_renew_enabled && is_rocking && ble_connected && chars_discovered) {
-            int64_t now = esp_timer_get_time() / 1000000;  // seconds
-            int64_t elapsed = now - rock_start_time;
-            int remaining = (auto_renew_duration * 60) - (int)elapsed;
-            
-            ESP_LOGI(TAG, "Auto-renew check: elapsed=%llds, remaining=%ds", elapsed, remaining);
-            
-            // Renew when threshold minutes remaining
-            if (remaining <= (auto_renew_threshold * 60) && remaining > 0) {
-                ESP_LOGI(TAG, "*** Auto-renewing rocking for %d min ***", auto_renew_duration);
-                rock_minutes = auto_renew_duration;
-                rock_start_time = now;  // Reset timer
-                pending_rock_start = 1;
-                process_pending_commands();
-                mqtt_publish_state();
+        uint32_t stored = 0;
+        uint8_t stored_mode = 0xFF;
+        nvs_handle_t nvs;
+        if (nvs_open("epriam", NVS_READONLY, &nvs) == ESP_OK) {
+            nvs_get_u32(nvs, "disc_hash", &stored);
+            nvs_get_u8(nvs, "disc_mode", &stored_mode);
+            nvs_close(nvs);
+        }
+        if (!force && stored == hash) {
+            ESP_LOGI(TAG, "MQTT discovery unchanged, not republished");
+            free(buf);
+            return;
+        }
+        // Switching format: remove the retained configs of the other one
+        if (stored_mode != 0xFF && stored_mode != mqtt_device_discovery) {
+            if (mqtt_device_discovery) {
+                for (int i = 0; i < ENT_COUNT; i++) {
+                    if (esp_mqtt_client_publish(mqtt_client, mqtt_topic_config[i], "", 0, 1, true) < 0) sent = false;
+                }
+            } else {
+                if (esp_mqtt_client_publish(mqtt_client, MQTT_DEVICE_DISCOVERY_TOPIC, "", 0, 1, true) < 0) sent = false;
             }
         }
     }
+    free(buf);
+    if (!sent) {
+        ESP_LOGW(TAG, "MQTT discovery publish failed, retrying on the next connect");
+        return;
+    }
+    
+    nvs_handle_t nvs;
+    if (nvs_open("epriam", NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_u32(nvs, "disc_hash", hash);
+        nvs_set_u8(nvs, "disc_mode", mqtt_device_discovery);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    ESP_LOGI(TAG, "MQTT discovery published (%s)", mqtt_device_discovery ? "device" : "per entity");
 }
 
 // MQTT event handler
@@ -662,76 +2799,53 @@ static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t id, voi
     esp_mqtt_event_handle_t event = data;
     switch (id) {
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT connected!");
+            DLOGI(LOG_MQTT, 0, "MQTT connected!");
             mqtt_connected = true;
-            // Publish discovery configs first
-            mqtt_publish_discovery();
-            vTaskDelay(pdMS_TO_TICKS(500));
-            // Subscribe to command topics
-            esp_mqtt_client_subscribe(mqtt_client, "homeassistant/switch/epriam_rocking/set", 0);
-            esp_mqtt_client_subscribe(mqtt_client, "homeassistant/select/epriam_mode/set", 0);
-            esp_mqtt_client_subscribe(mqtt_client, "homeassistant/switch/epriam_autorenew/set", 0);
-            esp_mqtt_client_subscribe(mqtt_client, "homeassistant/number/epriam_intensity/set", 0);
-            esp_mqtt_client_subscribe(mqtt_client, "homeassistant/select/epriam_duration/set", 0);
+            mqtt_shadow_stale = true;
+            mqtt_connected_us = esp_timer_get_time();
+            mqtt_connect_to_state_ms = -1;
+            esp_mqtt_client_publish(mqtt_client, MQTT_AVAIL_TOPIC, "online", 0, 1, true);
+            // Skipped when the broker already holds the same retained configs
+            mqtt_publish_discovery(false);
+            // HA announces "online" after it restarts and has lost discovery
+            esp_mqtt_client_subscribe(mqtt_client, MQTT_HA_STATUS_TOPIC, 0);
+            esp_mqtt_client_subscribe(mqtt_client, MQTT_LOG_LEVEL_TOPIC, 0);
+            // Subscribe to command topics; with a persistent session the broker
+            // holds QoS 1 commands sent while we were away
+            for (int i = 0; i < ENT_COUNT; i++) {
+                if (mqtt_entities[i].command) {
+                    esp_mqtt_client_subscribe(mqtt_client, mqtt_topic_cmd[i], mqtt_persistent ? 1 : 0);
+                }
+            }
             // Publish current state
             mqtt_publish_state();
             break;
         case MQTT_EVENT_DISCONNECTED:
             mqtt_connected = false;
-            ESP_LOGI(TAG, "MQTT disconnected");
+            DLOGI(LOG_MQTT, 0, "MQTT disconnected");
             break;
         case MQTT_EVENT_DATA:
             {
-                char topic[128], payload[64];
-                int tlen = event->topic_len < 127 ? event->topic_len : 127;
+                int ent = mqtt_dispatch_find(event->topic, event->topic_len);
+                char payload[64];
                 int plen = event->data_len < 63 ? event->data_len : 63;
-                memcpy(topic, event->topic, tlen); topic[tlen] = 0;
                 memcpy(payload, event->data, plen); payload[plen] = 0;
-                ESP_LOGI(TAG, "MQTT: %s = %s", topic, payload);
+                ESP_LOGI(TAG, "MQTT: %.*s = %s", event->topic_len, event->topic, payload);
                 
-                if (strstr(topic, "rocking/set")) {
-                    if (strcmp(payload, "ON") == 0) {
-                        if (auto_renew_enabled) {
-                            rock_minutes = auto_renew_duration;
-                            rock_start_time = esp_timer_get_time() / 1000000;
-                        }
-                        pending_rock_start = 1;
-                    } else {
-                        pending_rock_stop = 1;
-                        auto_renew_enabled = false;
+                if (ent == MQTT_TOPIC_HA_STATUS) {
+                    if (strcmp(payload, "online") == 0) {
+                        mqtt_publish_discovery(true);
+                        mqtt_shadow_stale = true;
+                        mqtt_publish_state();
                     }
-                    if (ble_connected && chars_discovered) process_pending_commands();
-                    mqtt_publish_state();
-                }
-                else if (strstr(topic, "mode/set")) {
-                    if (strcmp(payload, "ECO") == 0) pending_mode = 1;
-                    else if (strcmp(payload, "TOUR") == 0) pending_mode = 2;
-                    else if (strcmp(payload, "BOOST") == 0) pending_mode = 3;
-                    if (ble_connected && chars_discovered) process_pending_commands();
-                    mqtt_publish_state();
-                }
-                else if (strstr(topic, "autorenew/set")) {
-                    auto_renew_enabled = (strcmp(payload, "ON") == 0);
-                    if (auto_renew_enabled && is_rocking) {
-                        rock_start_time = esp_timer_get_time() / 1000000;
+                } else if (ent == MQTT_TOPIC_LOG_LEVEL) {
+                    char *eq = strchr(payload, '=');
+                    if (eq) *eq = 0;
+                    if (!log_level_set(eq ? payload : NULL, eq ? eq + 1 : payload)) {
+                        ESP_LOGW(TAG, "Bad log level: %s", payload);
                     }
-                    ESP_LOGI(TAG, "Auto-renew: %s", auto_renew_enabled ? "ON" : "OFF");
-                    mqtt_publish_state();
-                }
-                else if (strstr(topic, "intensity/set")) {
-                    int i = atoi(payload);
-                    if (i >= 0 && i <= 100) rock_intensity = i;
-                    mqtt_publish_state();
-                }
-                else if (strstr(topic, "duration/set")) {
-                    if (strcmp(payload, "30 min") == 0) auto_renew_duration = 30;
-                    else if (strcmp(payload, "1 hour") == 0) auto_renew_duration = 60;
-                    else if (strcmp(payload, "1.5 hours") == 0) auto_renew_duration = 90;
-                    else if (strcmp(payload, "2 hours") == 0) auto_renew_duration = 120;
-                    else if (strcmp(payload, "2.5 hours") == 0) auto_renew_duration = 150;
-                    else if (strcmp(payload, "3 hours") == 0) auto_renew_duration = 180;
-                    ESP_LOGI(TAG, "Duration set to %d min", auto_renew_duration);
-                    mqtt_publish_state();
+                } else if (ent >= 0) {
+                    mqtt_entities[ent].command(payload);
                 }
             }
             break;
@@ -740,155 +2854,6 @@ static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t id, voi
     }
 }
 
-static void mqtt_publish_state(void) {
-    if (!mqtt_connected) return;
-    
-    char buf[64];
-    
-    // Battery sensor - only publish valid values
-    if (battery_percent >= 0) {
-        snprintf(buf, 64, "%d", battery_percent);
-        esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_battery/state", buf, 0, 0, true);
-    }
-    
-    // Rocking switch state
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/switch/epriam_rocking/state", 
-        is_rocking ? "ON" : "OFF", 0, 0, true);
-    
-    // Auto-renew switch state
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/switch/epriam_autorenew/state",
-        auto_renew_enabled ? "ON" : "OFF", 0, 0, true);
-    
-    // Mode select state
-    const char* mode = drive_mode == 1 ? "ECO" : drive_mode == 2 ? "TOUR" : drive_mode == 3 ? "BOOST" : "UNKNOWN";
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/select/epriam_mode/state", mode, 0, 0, true);
-    
-    // Duration select state
-    const char* dur = auto_renew_duration == 30 ? "30 min" :
-                      auto_renew_duration == 60 ? "1 hour" :
-                      auto_renew_duration == 90 ? "1.5 hours" :
-                      auto_renew_duration == 120 ? "2 hours" :
-                      auto_renew_duration == 150 ? "2.5 hours" :
-                      auto_renew_duration == 180 ? "3 hours" : "2 hours";
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/select/epriam_duration/state", dur, 0, 0, true);
-    
-    // Intensity number
-    snprintf(buf, 64, "%d", rock_intensity);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/number/epriam_intensity/state", buf, 0, 0, true);
-    
-    // Connection status
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/binary_sensor/epriam_connected/state",
-        ble_connected ? "ON" : "OFF", 0, 0, true);
-    
-    // Remaining time sensor
-    int remaining = 0;
-    if (is_rocking && rock_minutes > 0 && rock_start_time > 0) {
-        int64_t now = esp_timer_get_time() / 1000000;
-        int elapsed = (int)(now - rock_start_time);
-        remaining = (rock_minutes * 60) - elapsed;
-        if (remaining < 0) remaining = 0;
-    }
-    snprintf(buf, 64, "%d", remaining);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_remaining/state", buf, 0, 0, true);
-    
-    // IP address sensor
-    esp_netif_ip_info_t ip_info;
-    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-    if (netif && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
-        snprintf(buf, 64, IPSTR, IP2STR(&ip_info.ip));
-        esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_ip/state", buf, 0, 0, true);
-    }
-}
-
-static void mqtt_publish_discovery(void) {
-    if (!mqtt_connected) return;
-    
-    static char buf[400];
-    
-    // Battery sensor with state_class for history tracking
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_battery\","
-        "\"state_topic\":\"homeassistant/sensor/epriam_battery/state\","
-        "\"device_class\":\"battery\",\"state_class\":\"measurement\","
-        "\"unit_of_measurement\":\"%%\","
-        "\"device\":{\"identifiers\":[\"epriam\"],\"name\":\"%s\",\"manufacturer\":\"Cybex\"}}",
-        name_battery, name_device);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_battery/config", buf, 0, 0, true);
-    
-    // Rocking switch
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_rocking\","
-        "\"state_topic\":\"homeassistant/switch/epriam_rocking/state\","
-        "\"command_topic\":\"homeassistant/switch/epriam_rocking/set\","
-        "\"icon\":\"mdi:baby-carriage\",\"device\":{\"identifiers\":[\"epriam\"]}}",
-        name_rocking);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/switch/epriam_rocking/config", buf, 0, 0, true);
-    
-    // Auto-renew switch
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_autorenew\","
-        "\"state_topic\":\"homeassistant/switch/epriam_autorenew/state\","
-        "\"command_topic\":\"homeassistant/switch/epriam_autorenew/set\","
-        "\"icon\":\"mdi:autorenew\",\"device\":{\"identifiers\":[\"epriam\"]}}",
-        name_autorenew);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/switch/epriam_autorenew/config", buf, 0, 0, true);
-    
-    // Mode select
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_mode\","
-        "\"state_topic\":\"homeassistant/select/epriam_mode/state\","
-        "\"command_topic\":\"homeassistant/select/epriam_mode/set\","
-        "\"options\":[\"ECO\",\"TOUR\",\"BOOST\"],\"icon\":\"mdi:speedometer\","
-        "\"device\":{\"identifiers\":[\"epriam\"]}}",
-        name_mode);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/select/epriam_mode/config", buf, 0, 0, true);
-    
-    // Duration select
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"Duration\",\"unique_id\":\"epriam_duration\","
-        "\"state_topic\":\"homeassistant/select/epriam_duration/state\","
-        "\"command_topic\":\"homeassistant/select/epriam_duration/set\","
-        "\"options\":[\"30 min\",\"1 hour\",\"1.5 hours\",\"2 hours\",\"2.5 hours\",\"3 hours\"],"
-        "\"icon\":\"mdi:timer-outline\",\"device\":{\"identifiers\":[\"epriam\"]}}");
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/select/epriam_duration/config", buf, 0, 0, true);
-    
-    // Intensity slider
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_intensity\","
-        "\"state_topic\":\"homeassistant/number/epriam_intensity/state\","
-        "\"command_topic\":\"homeassistant/number/epriam_intensity/set\","
-        "\"min\":0,\"max\":100,\"step\":10,\"icon\":\"mdi:vibrate\","
-        "\"device\":{\"identifiers\":[\"epriam\"]}}",
-        name_intensity);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/number/epriam_intensity/config", buf, 0, 0, true);
-    
-    // BLE Connected binary sensor
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"%s\",\"unique_id\":\"epriam_connected\","
-        "\"state_topic\":\"homeassistant/binary_sensor/epriam_connected/state\","
-        "\"payload_on\":\"ON\",\"payload_off\":\"OFF\","
-        "\"device_class\":\"connectivity\",\"device\":{\"identifiers\":[\"epriam\"]}}",
-        name_connected);
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/binary_sensor/epriam_connected/config", buf, 0, 0, true);
-    
-    // Remaining time sensor
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"Gjenstående tid\",\"unique_id\":\"epriam_remaining\","
-        "\"state_topic\":\"homeassistant/sensor/epriam_remaining/state\","
-        "\"unit_of_measurement\":\"s\",\"icon\":\"mdi:timer-outline\","
-        "\"device\":{\"identifiers\":[\"epriam\"]}}");
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_remaining/config", buf, 0, 0, true);
-    
-    // IP Address sensor
-    snprintf(buf, sizeof(buf),
-        "{\"name\":\"IP-adresse\",\"unique_id\":\"epriam_ip\","
-        "\"state_topic\":\"homeassistant/sensor/epriam_ip/state\","
-        "\"icon\":\"mdi:ip-network\",\"device\":{\"identifiers\":[\"epriam\"]}}");
-    esp_mqtt_client_publish(mqtt_client, "homeassistant/sensor/epriam_ip/config", buf, 0, 0, true);
-    
-    ESP_LOGI(TAG, "MQTT discovery published with custom names");
-}
-
 // Load entity names from NVS
 static void load_entity_names(void) {
     nvs_handle_t nvs;
@@ -901,6 +2866,12 @@ static void load_entity_names(void) {
         len = sizeof(name_mode); nvs_get_str(nvs, "n_mode", name_mode, &len);
         len = sizeof(name_intensity); nvs_get_str(nvs, "n_intensity", name_intensity, &len);
         len = sizeof(name_connected); nvs_get_str(nvs, "n_connected", name_connected, &len);
+        uint8_t json = 0;
+        if (nvs_get_u8(nvs, "json_state", &json) == ESP_OK) mqtt_json_state = json;
+        uint8_t dev = 0;
+        if (nvs_get_u8(nvs, "dev_disc", &dev) == ESP_OK) mqtt_device_discovery = dev;
+        uint8_t persist = 0;
+        if (nvs_get_u8(nvs, "mqtt_persist", &persist) == ESP_OK) mqtt_persistent = persist;
         nvs_close(nvs);
         ESP_LOGI(TAG, "Loaded entity names from NVS");
     }
@@ -917,6 +2888,9 @@ static void save_entity_names(void) {
         nvs_set_str(nvs, "n_mode", name_mode);
         nvs_set_str(nvs, "n_intensity", name_intensity);
         nvs_set_str(nvs, "n_connected", name_connected);
+        nvs_set_u8(nvs, "json_state", mqtt_json_state);
+        nvs_set_u8(nvs, "dev_disc", mqtt_device_discovery);
+        nvs_set_u8(nvs, "mqtt_persist", mqtt_persistent);
         nvs_commit(nvs);
         nvs_close(nvs);
         ESP_LOGI(TAG, "Saved entity names to NVS");
@@ -924,11 +2898,19 @@ static void save_entity_names(void) {
 }
 
 static void mqtt_init(void) {
+    mqtt_topics_init();
     esp_mqtt_client_config_t cfg = {
         .broker.address.uri = MQTT_BROKER,
         .credentials.username = MQTT_USER,
         .credentials.authentication.password = MQTT_PASS,
+        .credentials.client_id = MQTT_CLIENT_ID,
+        .session.disable_clean_session = mqtt_persistent,
+        .session.last_will = {
+            .topic = MQTT_AVAIL_TOPIC, .msg = "offline", .qos = 1, .retain = 1,
+        },
+        .outbox.limit = MQTT_OUTBOX_LIMIT,
     };
+    xTaskCreate(mqtt_pub_task, "mqtt_pub", 3072, NULL, 4, &mqtt_pub_handle);
     mqtt_client = esp_mqtt_client_init(&cfg);
     if (mqtt_client) {
         esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
@@ -939,88 +2921,555 @@ static void mqtt_init(void) {
     }
 }
 
-static esp_err_t root_handler(httpd_req_t *req) {
-    char batt[16];
-    if (battery_percent >= 0) snprintf(batt, 16, "%d%%", battery_percent);
-    else strcpy(batt, "?");
-    
-    const char* mode = drive_mode == 1 ? "ECO" : drive_mode == 2 ? "TOUR" : drive_mode == 3 ? "BOOST" : "?";
-    const char* auto_status = auto_renew_enabled ? "on" : "off";
-    
-    static char r[3400];
-    snprintf(r, sizeof(r),
-        "<!DOCTYPE html><html><head><meta charset=UTF-8><meta name=viewport content=\"width=device-width,initial-scale=1\">"
-        "<title>E-Priam</title><style>*{box-sizing:border-box}body{font-family:Arial;max-width:400px;margin:auto;padding:10px;background:#1a1a2e;color:#eee}"
-        ".c{background:#16213e;padding:15px;border-radius:8px;margin:8px 0}.b{padding:12px 20px;margin:3px;border:none;border-radius:6px;cursor:pointer}"
-        ".st{display:flex;flex-wrap:wrap;gap:8px}.si{flex:1;min-width:60px;text-align:center;padding:8px;background:#0a0a14;border-radius:6px}"
-        ".si b{font-size:18px}.si small{color:#888;font-size:10px;display:block}"
-        ".on{color:#4CAF50}.off{color:#f44336}#cd{font-size:24px;color:#FF9800;font-weight:bold}"
-        "a{color:#4CAF50}#log{background:#0a0a14;padding:8px;font-family:monospace;font-size:11px;max-height:150px;overflow-y:auto;white-space:pre-wrap}</style></head><body>"
-        "<h2 style=margin-bottom:5px>🍼 E-Priam</h2>"
-        "<div class=c><div class=st>"
-        "<div class=si><b class=%s>●</b><small>BLE</small></div>"
-        "<div class=si><b class=%s>●</b><small>MQTT</small></div>"
-        "<div class=si><b>🔋%s</b><small>Battery</small></div>"
-        "<div class=si><b>%s</b><small>Mode</small></div>"
-        "<div class=si><b class=%s>∞</b><small>Auto</small></div>"
-        "</div></div>"
-        "<div class=c id=rockbox style='text-align:center;display:none'><div id=cd>--:--</div><small>Remaining</small></div>"
-        "<div class=c><b class=b style=background:#4CAF50 onclick=\"fetch('/api/mode/eco').then(st)\">ECO</b>"
-        "<b class=b style=background:#2196F3 onclick=\"fetch('/api/mode/tour').then(st)\">TOUR</b>"
-        "<b class=b style=background:#f44336 onclick=\"fetch('/api/mode/boost').then(st)\">BOOST</b></div>"
-        "<div class=c><b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=30').then(st)\">30m</b>"
-        "<b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=60').then(st)\">1h</b>"
-        "<b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=90').then(st)\">1.5h</b></div>"
-        "<div class=c><b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=120').then(st)\">2h</b>"
-        "<b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=150').then(st)\">2.5h</b>"
-        "<b class=b style=background:#9C27B0 onclick=\"fetch('/api/rock/start?min=180').then(st)\">3h</b></div>"
-        "<div class=c><b id=abtn class=b style=background:%s onclick=\"fetch('/api/rock/autorenew').then(st)\">∞ Auto</b>"
-        "<b class=b style=background:#666 onclick=\"fetch('/api/rock/stop').then(st)\">Stop</b></div>"
-        "<div class=c>%s<a href=/config>⚙ Config</a> <a href=/ota style=float:right>🔄 OTA</a></div>"
-        "<div class=c><b>BLE Log:</b><div id=log>Loading...</div></div>"
-        "<script>var ar=%s;function st(){fetch('/api/status').then(r=>r.json()).then(d=>{rs=d.remaining_sec;rk=d.rocking;ar=d.auto_renew;"
-        "document.getElementById('rockbox').style.display=rk?'block':'none';document.getElementById('abtn').style.background=ar?'#4CAF50':'#FF9800';upcd()})}"
-        "var rs=0,rk=false;function upcd(){if(!rk||rs<=0){document.getElementById('cd').textContent='--:--';return;}"
-        "var m=Math.floor(rs/60),s=rs%%60;document.getElementById('cd').textContent=m+':'+(s<10?'0':'')+s}"
-        "function upd(){fetch('/api/log').then(r=>r.text()).then(t=>{document.getElementById('log').textContent=t})}"
-        "st();upd();setInterval(()=>{if(rk&&rs>0){rs--;upcd()}},1000);setInterval(st,10000);setInterval(upd,5000)</script></body></html>",
-        ble_connected ? "on" : "off", mqtt_connected ? "on" : "off", batt, mode, auto_status,
-        auto_renew_enabled ? "#4CAF50" : "#FF9800",
-        ble_connected ? "" : "<b class=b style=background:#FF5722 onclick=\"fetch('/api/rescan').then(()=>setTimeout(()=>location.reload(),3000))\">🔍 Scan</b>",
-        auto_renew_enabled ? "true" : "false");
-    
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, r, strlen(r));
-    return ESP_OK;
+// Chunked response writer
+// Handlers format into a small stack buffer that goes out as an HTTP chunk
+// whenever it fills, so no response needs a buffer of its full size and no
+// handler needs a static one.
+#define CW_BUF_LEN 384
+
+typedef struct {
+    httpd_req_t *req;
+    int len;
+    esp_err_t err;  // First send error; later writes are dropped
+    char buf[CW_BUF_LEN];
+} chunk_writer_t;
+
+static void cw_begin(chunk_writer_t *w, httpd_req_t *req, const char *type) {
+    w->req = req;
+    w->len = 0;
+    w->err = ESP_OK;
+    httpd_resp_set_type(req, type);
 }
 
-static esp_err_t api_status(httpd_req_t *req) {
-    // Calculate remaining seconds
-    int remaining_sec = 0;
-    if (is_rocking && rock_start_time > 0) {
-        int64_t now = esp_timer_get_time() / 1000000; // to seconds
-        int64_t elapsed = now - rock_start_time;  // rock_start_time is already in seconds
-        int duration_sec = auto_renew_enabled ? (auto_renew_duration * 60) : (rock_minutes * 60);
-        remaining_sec = duration_sec - (int)elapsed;
-        if (remaining_sec < 0) remaining_sec = 0;
-    }
-    char r[450];
-    snprintf(r, sizeof(r), "{\"connected\":%s,\"mqtt\":%s,\"battery\":%d,\"battery_leds\":%d,\"drive_mode\":%d,\"rocking\":%s,\"auto_renew\":%s,\"intensity\":%d,\"remaining_sec\":%d,\"rock_minutes\":%d}",
-        ble_connected ? "true" : "false", mqtt_connected ? "true" : "false",
-        battery_percent, battery_leds, drive_mode, 
-        is_rocking ? "true" : "false", auto_renew_enabled ? "true" : "false", rock_intensity, remaining_sec, rock_minutes);
+static void cw_flush(chunk_writer_t *w) {
+    if (w->len && w->err == ESP_OK) w->err = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    w->len = 0;
+}
+
+static void cw_write(chunk_writer_t *w, const char *data, int len) {
+    while (len > 0) {
+        if (w->len == CW_BUF_LEN) cw_flush(w);
+        int n = CW_BUF_LEN - w->len < len ? CW_BUF_LEN - w->len : len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static esp_err_t cw_end(chunk_writer_t *w) {
+    cw_flush(w);
+    if (w->err == ESP_OK) w->err = httpd_resp_send_chunk(w->req, NULL, 0);
+    return w->err;
+}
+
+// json_writer_t sink that streams into the chunk writer
+static void cw_sink(void *ctx, const char *data, int len) {
+    cw_write(ctx, data, len);
+}
+
+// Static web UI
+// The pages in web/ are gzip-compressed at build time (src/CMakeLists.txt) and
+// embedded as-is; every dynamic value comes from /api/status, /api/events and
+// /api/config. Pages revalidate with their ETag; app.css/app.js are referenced
+// by content hash, so browsers may keep them for a year.
+#define WEB_CACHE_PAGE "no-cache"
+#define WEB_CACHE_ASSET "public, max-age=31536000, immutable"
+
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[] asm("_binary_index_html_gz_end");
+extern const uint8_t config_html_gz_start[] asm("_binary_config_html_gz_start");
+extern const uint8_t config_html_gz_end[] asm("_binary_config_html_gz_end");
+extern const uint8_t ota_html_gz_start[] asm("_binary_ota_html_gz_start");
+extern const uint8_t ota_html_gz_end[] asm("_binary_ota_html_gz_end");
+extern const uint8_t app_js_gz_start[] asm("_binary_app_js_gz_start");
+extern const uint8_t app_js_gz_end[] asm("_binary_app_js_gz_end");
+extern const uint8_t app_css_gz_start[] asm("_binary_app_css_gz_start");
+extern const uint8_t app_css_gz_end[] asm("_binary_app_css_gz_end");
+
+typedef struct {
+    const uint8_t *start;
+    const uint8_t *end;
+    const char *type;
+    const char *cache;
+    char etag[12];  // Filled by web_assets_init()
+} web_asset_t;
+
+typedef enum { WEB_INDEX, WEB_CONFIG, WEB_OTA, WEB_JS, WEB_CSS, WEB_COUNT } web_asset_id_t;
+
+static web_asset_t web_assets[WEB_COUNT] = {
+    [WEB_INDEX] = {index_html_gz_start, index_html_gz_end, "text/html", WEB_CACHE_PAGE},
+    [WEB_CONFIG] = {config_html_gz_start, config_html_gz_end, "text/html", WEB_CACHE_PAGE},
+    [WEB_OTA] = {ota_html_gz_start, ota_html_gz_end, "text/html", WEB_CACHE_PAGE},
+    [WEB_JS] = {app_js_gz_start, app_js_gz_end, "application/javascript", WEB_CACHE_ASSET},
+    [WEB_CSS] = {app_css_gz_start, app_css_gz_end, "text/css", WEB_CACHE_ASSET},
+};
+
+static void web_assets_init(void) {
+    for (int i = 0; i < WEB_COUNT; i++) {
+        web_asset_t *a = &web_assets[i];
+        snprintf(a->etag, sizeof(a->etag), "\"%08lx\"",
+            (unsigned long)fnv1a(a->start, a->end - a->start, FNV1A_INIT));
+    }
+}
+
+static esp_err_t web_asset_handler(httpd_req_t *req) {
+    const web_asset_t *a = req->user_ctx;
+    httpd_resp_set_hdr(req, "ETag", a->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", a->cache);
+    char inm[sizeof(a->etag)];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK &&
+        strcmp(inm, a->etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    httpd_resp_set_type(req, a->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char *)a->start, a->end - a->start);
+}
+
+// Event log text
+// Records are formatted only here, on the reading side.
+
+// Advertised name of addr from the seen table; "?" once it has been evicted
+static void ev_seen_name(const ble_addr_t *addr, char *out, int len) {
+    snprintf(out, len, "?");
+    portENTER_CRITICAL(&seen_mux);
+    for (int i = 0; i < SEEN_SLOTS; i++) {
+        if (seen[i].used && seen[i].name[0] && ble_addr_cmp(&seen[i].addr, addr) == 0) {
+            snprintf(out, len, "%.*s", (int)sizeof(seen[i].name), seen[i].name);
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&seen_mux);
+}
+
+// Message text of a record: each conversion of the event's fmt is printed on
+// its own with the argument its args letter names
+static int ev_format(const ev_rec_t *e, char *out, int len) {
+    const ev_desc_t *d = &ev_descs[e->id < EV_COUNT ? e->id : EV_COUNT - 1];
+    const char *f = d->fmt, *k = d->args;
+    int n = 0, ai = 0;
+    while (*f && n < len - 1) {
+        if (*f != '%') {
+            out[n++] = *f++;
+            continue;
+        }
+        char spec[8], s[24];
+        int sl = 1;
+        while (sl < 6 && f[sl] && !isalpha((unsigned char)f[sl])) sl++;
+        memcpy(spec, f, sl + 1);
+        spec[sl + 1] = 0;
+        f += sl + 1;
+        char kind = *k ? *k++ : 0;
+        int m = 0;
+        switch (kind) {
+            case 'd': m = snprintf(out + n, len - n, spec, (int)e->arg[ai < 2 ? ai++ : 1]); break;
+            case 's': m = snprintf(out + n, len - n, spec, e->str ? e->str : "?"); break;
+            case 't': m = snprintf(out + n, len - n, spec, e->addr.type); break;
+            case 'a':
+                addr_to_str(&e->addr, s);
+                m = snprintf(out + n, len - n, spec, s);
+                break;
+            case 'n':
+                ev_seen_name(&e->addr, s, sizeof(s));
+                m = snprintf(out + n, len - n, spec, s);
+                break;
+        }
+        if (m > 0) n += m;
+    }
+    if (n > len - 1) n = len - 1;
+    out[n] = 0;
+    return n;
+}
+
+// "<seconds since boot> <message>"
+static int ev_format_line(const ev_rec_t *e, char *out, int len) {
+    int n = snprintf(out, len, "%lu.%03lu ", (unsigned long)(e->ms / 1000), (unsigned long)(e->ms % 1000));
+    if (n >= len) return len - 1;
+    return n + ev_format(e, out + n, len - n);
+}
+
+// Status snapshot
+// /api/status serves a document rendered by sse_task (every SSE_TICK_MS and on
+// every mqtt_publish_state()), so requests never format anything. The version
+// only moves when a field changes; remaining_sec counting down on schedule
+// doesn't count, and link_quality is the published value (steps of 10 or
+// more), so rssi drift doesn't either. ETag is the version, and ?wait=<version> parks
+// the request until the version moves or the timeout passes.
+#define STATUS_WAITERS 2
+#define STATUS_WAIT_DEFAULT_S 30
+#define STATUS_WAIT_MAX_S 60
+
+// Every field of the document except version and rssi; REMAINING stays last
+typedef enum {
+    ST_F_CONNECTED, ST_F_MQTT, ST_F_BATTERY, ST_F_BATTERY_LEDS, ST_F_DRIVE_MODE, ST_F_ROCKING,
+    ST_F_AUTO_RENEW, ST_F_INTENSITY, ST_F_ROCK_MINUTES, ST_F_LINK, ST_F_LINK_DETECT, ST_F_REMAINING, ST_F_COUNT
+} status_field_t;
+
+static const char *const status_field_keys[ST_F_COUNT] = {
+    "connected", "mqtt", "battery", "battery_leds", "drive_mode", "rocking", "auto_renew", "intensity",
+    "rock_minutes", "link_quality", "link_detect_ms", "remaining_sec",
+};
+#define ST_BOOL_FIELDS ((1u << ST_F_CONNECTED) | (1u << ST_F_MQTT) | (1u << ST_F_ROCKING) | (1u << ST_F_AUTO_RENEW))
+
+typedef struct {
+    httpd_req_t *req;  // NULL = free
+    uint32_t version;
+    int64_t deadline_us;
+} status_waiter_t;
+
+static SemaphoreHandle_t status_lock = NULL;
+static uint32_t status_version = 0;
+static int status_fields[ST_F_COUNT];
+static int64_t status_fields_us = 0;  // When status_fields[ST_F_REMAINING] was taken
+static char status_doc[560];
+static int status_doc_len = 0;
+static status_waiter_t status_waiters[STATUS_WAITERS];
+static volatile uint32_t status_not_modified = 0;
+
+static void status_render_fields(const bridge_state_t *s, int v[ST_F_COUNT]) {
+    v[ST_F_CONNECTED] = ble_connected;
+    v[ST_F_MQTT] = mqtt_connected;
+    v[ST_F_BATTERY] = s->battery;
+    v[ST_F_BATTERY_LEDS] = s->battery_leds;
+    v[ST_F_DRIVE_MODE] = s->drive_mode;
+    v[ST_F_ROCKING] = s->rocking;
+    v[ST_F_AUTO_RENEW] = s->auto_renew;
+    v[ST_F_INTENSITY] = s->intensity;
+    v[ST_F_ROCK_MINUTES] = s->rock_minutes;
+    v[ST_F_LINK] = link_quality_published;  // Not link_quality: rssi noise moves that every tick
+    v[ST_F_LINK_DETECT] = link_detect_ms;
+    v[ST_F_REMAINING] = rock_remaining_sec(s);
+}
+
+// JSON object with the fields in mask
+static int status_fields_json(char *out, size_t len, const int v[ST_F_COUNT], uint32_t mask) {
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, out, len);
+    jw_obj(&j, NULL);
+    for (int i = 0; i < ST_F_COUNT; i++) {
+        if (!(mask & (1u << i))) continue;
+        if (ST_BOOL_FIELDS & (1u << i)) jw_bool(&j, status_field_keys[i], v[i]);
+        else jw_int(&j, status_field_keys[i], v[i]);
+    }
+    jw_obj_end(&j);
+    return json_buf_ok(&b) ? b.len : (int)len - 1;
+}
+
+// Re-render the document; returns the mask of fields that changed (0 = same version)
+static uint32_t status_refresh(void) {
+    bridge_state_t st;
+    state_get(&st);
+    int v[ST_F_COUNT];
+    status_render_fields(&st, v);
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    uint32_t mask = 0;
+    for (int i = 0; i < ST_F_REMAINING; i++) {
+        if (v[i] != status_fields[i]) mask |= 1u << i;
+    }
+    // A countdown that runs on schedule is not a change
+    int expected = status_fields[ST_F_REMAINING] - (int)((now - status_fields_us) / 1000000);
+    if (expected < 0) expected = 0;
+    if (mask || abs(v[ST_F_REMAINING] - expected) > 2) mask |= 1u << ST_F_REMAINING;
+    if (mask || !status_version) {
+        if (!status_version) mask = (1u << ST_F_COUNT) - 1;
+        memcpy(status_fields, v, sizeof(status_fields));
+        status_fields_us = now;
+        status_version++;
+    }
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, status_doc, sizeof(status_doc));
+    jw_obj(&j, NULL);
+    jw_uint(&j, "version", status_version);
+    jw_bool(&j, "connected", v[ST_F_CONNECTED]);
+    jw_bool(&j, "mqtt", v[ST_F_MQTT]);
+    jw_int(&j, "battery", v[ST_F_BATTERY]);
+    jw_int(&j, "battery_leds", v[ST_F_BATTERY_LEDS]);
+    jw_int(&j, "drive_mode", v[ST_F_DRIVE_MODE]);
+    jw_bool(&j, "rocking", v[ST_F_ROCKING]);
+    jw_bool(&j, "auto_renew", v[ST_F_AUTO_RENEW]);
+    jw_int(&j, "intensity", v[ST_F_INTENSITY]);
+    jw_int(&j, "remaining_sec", v[ST_F_REMAINING]);
+    jw_int(&j, "rock_minutes", v[ST_F_ROCK_MINUTES]);
+    jw_int(&j, "link_quality", v[ST_F_LINK]);
+    jw_int(&j, "rssi", link_rssi);
+    jw_int(&j, "link_detect_ms", v[ST_F_LINK_DETECT]);
+    jw_obj_end(&j);
+    status_doc_len = json_buf_ok(&b) ? b.len : (int)sizeof(status_doc) - 1;
+    xSemaphoreGive(status_lock);
+    return mask;
+}
+
+// Send the current document with its ETag
+static esp_err_t status_send(httpd_req_t *req) {
+    char doc[sizeof(status_doc)], etag[16];
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    memcpy(doc, status_doc, status_doc_len);
+    int len = status_doc_len;
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)status_version);
+    xSemaphoreGive(status_lock);
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, r, strlen(r));
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    return httpd_resp_send(req, doc, len);
+}
+
+// Answer parked long-polls whose version moved or whose timeout passed (sse_task)
+static void status_wake_waiters(void) {
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < STATUS_WAITERS; i++) {
+        status_waiter_t *w = &status_waiters[i];
+        xSemaphoreTake(status_lock, portMAX_DELAY);
+        bool due = w->req && (w->version != status_version || now >= w->deadline_us);
+        httpd_req_t *req = due ? w->req : NULL;
+        if (due) w->req = NULL;
+        xSemaphoreGive(status_lock);
+        if (req) {
+            status_send(req);
+            httpd_req_async_handler_complete(req);
+        }
+    }
+}
+
+static esp_err_t api_status(httpd_req_t *req) {
+    char q[48], val[12];
+    if (httpd_req_get_url_query_str(req, q, sizeof(q)) == ESP_OK &&
+        httpd_query_key_value(q, "wait", val, sizeof(val)) == ESP_OK) {
+        uint32_t wait = strtoul(val, NULL, 10);
+        int timeout = STATUS_WAIT_DEFAULT_S;
+        if (httpd_query_key_value(q, "timeout", val, sizeof(val)) == ESP_OK) timeout = atoi(val);
+        if (timeout < 1) timeout = 1;
+        if (timeout > STATUS_WAIT_MAX_S) timeout = STATUS_WAIT_MAX_S;
+
+        xSemaphoreTake(status_lock, portMAX_DELAY);
+        status_waiter_t *w = NULL;
+        if (wait == status_version) {
+            for (int i = 0; i < STATUS_WAITERS && !w; i++) {
+                if (!status_waiters[i].req) w = &status_waiters[i];
+            }
+        }
+        httpd_req_t *areq = NULL;
+        if (w && httpd_req_async_handler_begin(req, &areq) == ESP_OK) {
+            w->req = areq;
+            w->version = wait;
+            w->deadline_us = esp_timer_get_time() + timeout * 1000000LL;
+        }
+        xSemaphoreGive(status_lock);
+        if (areq) return ESP_OK;
+        // Already changed (or no free waiter slot): answer now
+        return status_send(req);
+    }
+
+    char inm[16];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK) {
+        char etag[16];
+        xSemaphoreTake(status_lock, portMAX_DELAY);
+        snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)status_version);
+        xSemaphoreGive(status_lock);
+        if (strcmp(inm, etag) == 0) {
+            status_not_modified++;
+            httpd_resp_set_status(req, "304 Not Modified");
+            httpd_resp_set_hdr(req, "ETag", etag);
+            return httpd_resp_send(req, NULL, 0);
+        }
+    }
+    return status_send(req);
+}
+
+
+// Web UI push channel (Server-Sent Events)
+// /api/events keeps its request open via the async handler API. Messages go
+// into a shared ring; each client only holds a cursor into it, so posting is a
+// copy under a mutex and never touches a socket. sse_lock is never held across
+// a send. sse_task does all sending (including /api/status long-poll replies):
+// a client that falls a whole ring behind or fails a send is dropped, and
+// EventSource reconnects on its own.
+#define SSE_MAX_CLIENTS 2
+#define SSE_RING 16
+#define SSE_MSG_LEN 256  // Fits the full status snapshot
+#define SSE_TICK_MS 1000
+#define SSE_HEARTBEAT_MS 15000
+
+typedef struct {
+    httpd_req_t *req;  // NULL = free
+    bool ready;        // Snapshot sent; sse_task may stream to it
+    uint32_t next;     // Next ring sequence to send
+    int64_t last_tx_us;
+} sse_client_t;
+
+static char sse_ring[SSE_RING][SSE_MSG_LEN];
+static uint16_t sse_ring_len[SSE_RING];
+static uint32_t sse_head = 0;  // Sequence of the next message
+static sse_client_t sse_clients[SSE_MAX_CLIENTS];
+static SemaphoreHandle_t sse_lock = NULL;
+static TaskHandle_t sse_handle = NULL;
+static volatile uint32_t sse_dropped = 0;
+
+static void sse_notify(void) {
+    if (sse_handle) xTaskNotifyGive(sse_handle);
+}
+
+static void sse_post(const char *event, const char *data, int len) {
+    if (!sse_lock) return;
+    xSemaphoreTake(sse_lock, portMAX_DELAY);
+    int slot = sse_head % SSE_RING;
+    int n = snprintf(sse_ring[slot], SSE_MSG_LEN, "event: %s\ndata: %.*s\n\n", event, len, data);
+    sse_ring_len[slot] = n < SSE_MSG_LEN ? n : SSE_MSG_LEN - 1;
+    sse_head++;
+    xSemaphoreGive(sse_lock);
+    sse_notify();
+}
+
+// Post "log" events for new records, a bounded batch per pass so a burst
+// cannot push every client a whole ring behind at once
+static uint32_t sse_log_seq = 1;  // Next record to post
+
+static void sse_check_log(void) {
+    uint32_t head = ev_next_seq();
+    if (head - sse_log_seq > EVLOG_SLOTS) sse_log_seq = head - EVLOG_SLOTS;
+    char line[EV_LINE_LEN];
+    ev_rec_t e;
+    for (int n = 0; sse_log_seq != head; sse_log_seq++) {
+        if (n++ == SSE_RING / 2) {
+            sse_notify();  // Rest on the next pass, after clients caught up
+            break;
+        }
+        if (ev_read(sse_log_seq, &e)) sse_post("log", line, ev_format_line(&e, line, sizeof(line)));
+    }
+}
+
+// Refresh the status snapshot; post a "state" event with what changed
+static void sse_check_state(void) {
+    uint32_t mask = status_refresh();
+    if (!mask) return;
+    char json[SSE_MSG_LEN - 32];
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    int n = status_fields_json(json, sizeof(json), status_fields, mask);
+    xSemaphoreGive(status_lock);
+    sse_post("state", json, n);
+}
+
+// sse_task only, for a client it is streaming to
+static void sse_drop(sse_client_t *c) {
+    httpd_sess_trigger_close(server, httpd_req_to_sockfd(c->req));
+    httpd_req_async_handler_complete(c->req);
+    xSemaphoreTake(sse_lock, portMAX_DELAY);
+    c->req = NULL;
+    c->ready = false;
+    xSemaphoreGive(sse_lock);
+    sse_dropped++;
+}
+
+// Copy out the client's next message under the lock, send it after
+static void sse_flush(sse_client_t *c, int64_t now) {
+    char msg[SSE_MSG_LEN];
+    while (1) {
+        xSemaphoreTake(sse_lock, portMAX_DELAY);
+        bool live = c->req && c->ready;
+        bool behind = live && sse_head - c->next > SSE_RING;
+        int len = 0;
+        if (live && !behind && c->next != sse_head) {
+            int slot = c->next % SSE_RING;
+            len = sse_ring_len[slot];
+            memcpy(msg, sse_ring[slot], len);
+        }
+        xSemaphoreGive(sse_lock);
+        if (behind) {
+            ESP_LOGW(TAG, "SSE client %d too slow, dropped", (int)(c - sse_clients));
+            sse_drop(c);
+            return;
+        }
+        if (!len) break;
+        // Blocks at most send_wait_timeout; only this task waits
+        if (httpd_resp_send_chunk(c->req, msg, len) != ESP_OK) {
+            sse_drop(c);
+            return;
+        }
+        c->next++;
+        c->last_tx_us = now;
+    }
+    if (c->req && c->ready && now - c->last_tx_us > SSE_HEARTBEAT_MS * 1000LL) {
+        if (httpd_resp_send_chunk(c->req, ": ping\n\n", 8) != ESP_OK) sse_drop(c);
+        else c->last_tx_us = now;
+    }
+}
+
+static void sse_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SSE_TICK_MS));
+        sse_check_log();
+        sse_check_state();
+        status_wake_waiters();
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < SSE_MAX_CLIENTS; i++) sse_flush(&sse_clients[i], now);
+    }
+}
+
+static esp_err_t api_events(httpd_req_t *req) {
+    httpd_req_t *areq;
+    if (httpd_req_async_handler_begin(req, &areq) != ESP_OK) return ESP_FAIL;
+    httpd_resp_set_type(areq, "text/event-stream");
+    httpd_resp_set_hdr(areq, "Cache-Control", "no-cache");
+
+    // Reserve a slot; sse_task leaves it alone until ready
+    xSemaphoreTake(sse_lock, portMAX_DELAY);
+    sse_client_t *c = NULL;
+    for (int i = 0; i < SSE_MAX_CLIENTS && !c; i++) {
+        if (!sse_clients[i].req) c = &sse_clients[i];
+    }
+    if (c) {
+        c->req = areq;
+        c->ready = false;
+        c->next = sse_head;  // Deltas from here on; some may repeat the snapshot
+    }
+    xSemaphoreGive(sse_lock);
+    if (!c) {
+        httpd_resp_set_status(areq, "503 Service Unavailable");
+        httpd_resp_sendstr(areq, "retry: 10000\n\n");
+        httpd_req_async_handler_complete(areq);
+        return ESP_OK;
+    }
+    // Full snapshot first, then deltas
+    char json[SSE_MSG_LEN - 32], msg[SSE_MSG_LEN];
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    status_fields_json(json, sizeof(json), status_fields, (1u << ST_F_COUNT) - 1);
+    xSemaphoreGive(status_lock);
+    int n = snprintf(msg, sizeof(msg), "retry: 3000\n\nevent: state\ndata: %s\n\n", json);
+    bool ok = httpd_resp_send_chunk(areq, msg, n) == ESP_OK;
+    xSemaphoreTake(sse_lock, portMAX_DELAY);
+    if (ok) {
+        c->last_tx_us = esp_timer_get_time();
+        c->ready = true;
+    } else {
+        c->req = NULL;
+    }
+    xSemaphoreGive(sse_lock);
+    if (!ok) {
+        httpd_req_async_handler_complete(areq);
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "SSE client attached (fd %d)", httpd_req_to_sockfd(areq));
+    sse_notify();
     return ESP_OK;
 }
 
+static void sse_init(void) {
+    sse_lock = xSemaphoreCreateMutex();
+    status_lock = xSemaphoreCreateMutex();
+    status_refresh();
+    xTaskCreate(sse_task, "sse", 3072, NULL, 3, &sse_handle);
+}
+
 static esp_err_t api_rescan(httpd_req_t *req) {
     if (!ble_connected) {
         ESP_LOGI(TAG, "Manual rescan triggered");
-        web_log_add("Manual scan started");
-        ble_gap_disc_cancel();  // Cancel any ongoing scan
-        vTaskDelay(pdMS_TO_TICKS(100));
-        ble_app_scan();  // Start new scan
+        ev_log(EV_MANUAL_SCAN, NULL, 0, 0, NULL);
+        conn_rescan_now();  // Restarted on the host task
         httpd_resp_sendstr(req, "{\"ok\":true,\"msg\":\"Scanning...\"}");
     } else {
         httpd_resp_sendstr(req, "{\"ok\":false,\"msg\":\"Already connected\"}");
@@ -1028,142 +3477,402 @@ static esp_err_t api_rescan(httpd_req_t *req) {
     return ESP_OK;
 }
 
-// Log endpoint - returns circular log buffer (newest first)
+// Seen-device table (unsorted; each entry carries its candidate score)
+static esp_err_t api_scan(httpd_req_t *req) {
+    chunk_writer_t w;
+    json_writer_t j;
+    cw_begin(&w, req, "application/json");
+    jw_init(&j, cw_sink, &w);
+    uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+    jw_obj(&j, NULL);
+    jw_int(&j, "cycle", scan_cycle_count);
+    jw_int(&j, "seen", seen_count);
+    jw_arr(&j, "devices");
+    for (int i = 0; i < SEEN_SLOTS; i++) {
+        portENTER_CRITICAL(&seen_mux);
+        seen_dev_t d = seen[i];
+        portEXIT_CRITICAL(&seen_mux);
+        if (!d.used) continue;
+        char addr_str[18];
+        addr_to_str(&d.addr, addr_str);
+        jw_obj(&j, NULL);
+        jw_str(&j, "addr", addr_str);
+        jw_int(&j, "type", d.addr.type);
+        jw_str(&j, "name", d.name);
+        jw_int(&j, "mfg", d.mfg_id);
+        jw_int(&j, "rssi", d.rssi_x16 / 16);
+        jw_uint(&j, "count", d.count);
+        jw_uint(&j, "age_ms", now - d.last_ms);
+        jw_bool(&j, "priam", d.priam);
+        jw_int(&j, "score", seen_score(&d));
+        jw_obj_end(&j);
+    }
+    jw_arr_end(&j);
+    jw_obj_end(&j);
+    return cw_end(&w);
+}
+
+// Scan tuning: /api/scan/config?mode=open|filtered|wl&itvl=&window=&scan=&idle= (ms)
+// Takes effect from the next scan cycle
+static esp_err_t api_scan_config(httpd_req_t *req) {
+    char buf[96];
+    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
+        char param[16];
+        int itvl = scan_itvl_ms, window = scan_window_ms;
+        if (httpd_query_key_value(buf, "mode", param, sizeof(param)) == ESP_OK) {
+            for (int i = 0; i < 3; i++) {
+                if (strcmp(param, scan_mode_names[i]) == 0) scan_mode = (scan_mode_t)i;
+            }
+        }
+        if (httpd_query_key_value(buf, "itvl", param, sizeof(param)) == ESP_OK) itvl = atoi(param);
+        if (httpd_query_key_value(buf, "window", param, sizeof(param)) == ESP_OK) window = atoi(param);
+        if (itvl >= 3 && itvl <= 10240 && window >= 3 && window <= itvl) {
+            scan_itvl_ms = itvl;
+            scan_window_ms = window;
+        }
+        if (httpd_query_key_value(buf, "scan", param, sizeof(param)) == ESP_OK) {
+            int d = atoi(param);
+            if (d >= 1000 && d <= 60000) scan_duration_ms = d;
+        }
+        if (httpd_query_key_value(buf, "idle", param, sizeof(param)) == ESP_OK) {
+            int d = atoi(param);
+            if (d >= 0 && d <= 600000) scan_idle_ms = d;
+        }
+    }
+    char resp[160];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, resp, sizeof(resp));
+    jw_obj(&j, NULL);
+    jw_str(&j, "mode", scan_mode_names[scan_mode]);
+    jw_int(&j, "itvl", scan_itvl_ms);
+    jw_int(&j, "window", scan_window_ms);
+    jw_int(&j, "scan", scan_duration_ms);
+    jw_int(&j, "idle", scan_idle_ms);
+    jw_uint(&j, "adv_rx", scan_adv_rx);
+    jw_uint(&j, "adv_parsed", scan_adv_parsed);
+    jw_obj_end(&j);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, resp);
+    return ESP_OK;
+}
+
+// Connection-parameter profiles:
+// /api/connparams?profile=fast|idle&min=&max=&latency=&timeout=&hold=
+// min/max in 1.25 ms units, timeout in 10 ms units, hold in ms
+static esp_err_t api_connparams(httpd_req_t *req) {
+    char buf[128];
+    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
+        char param[16];
+        int p = -1;
+        if (httpd_query_key_value(buf, "profile", param, sizeof(param)) == ESP_OK) {
+            for (int i = 0; i < CONNPARAM_COUNT; i++) {
+                if (strcmp(param, connparam_names[i]) == 0) p = i;
+            }
+        }
+        if (p >= 0) {
+            connparam_t c = connparam_profiles[p];
+            if (httpd_query_key_value(buf, "min", param, sizeof(param)) == ESP_OK) c.itvl_min = atoi(param);
+            if (httpd_query_key_value(buf, "max", param, sizeof(param)) == ESP_OK) c.itvl_max = atoi(param);
+            if (httpd_query_key_value(buf, "latency", param, sizeof(param)) == ESP_OK) c.latency = atoi(param);
+            if (httpd_query_key_value(buf, "timeout", param, sizeof(param)) == ESP_OK) c.timeout = atoi(param);
+            // Core spec limits; the timeout must outlast (1 + latency) * interval * 2
+            if (c.itvl_min >= 6 && c.itvl_min <= c.itvl_max && c.itvl_max <= 3200 && c.latency <= 499 &&
+                c.timeout >= 10 && c.timeout <= 3200 &&
+                (uint32_t)c.timeout * 10 * 4 > (1u + c.latency) * c.itvl_max * 5 * 2) {
+                connparam_profiles[p] = c;
+                if (connparam_requested == p) connparam_requested = -1;  // Re-apply on next switch
+            }
+        }
+        if (httpd_query_key_value(buf, "hold", param, sizeof(param)) == ESP_OK) {
+            int h = atoi(param);
+            if (h >= 0 && h <= 600000) connparam_idle_hold_ms = h;
+        }
+    }
+    char resp[400];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, resp, sizeof(resp));
+    jw_obj(&j, NULL);
+    for (int p = 0; p < CONNPARAM_COUNT; p++) {
+        const connparam_t *c = &connparam_profiles[p];
+        jw_obj(&j, connparam_names[p]);
+        jw_int(&j, "min", c->itvl_min);
+        jw_int(&j, "max", c->itvl_max);
+        jw_int(&j, "latency", c->latency);
+        jw_int(&j, "timeout", c->timeout);
+        jw_obj_end(&j);
+    }
+    jw_uint(&j, "hold", connparam_idle_hold_ms);
+    jw_str(&j, "requested", connparam_requested >= 0 ? connparam_names[connparam_requested] : "none");
+    jw_uint(&j, "itvl_us", (unsigned long)conn_itvl * 1250);
+    jw_int(&j, "latency", conn_latency);
+    jw_uint(&j, "timeout_ms", (unsigned long)conn_timeout * 10);
+    jw_uint(&j, "rtt_ms", cmd_rtt_ms);
+    jw_uint(&j, "rtt_fast_ms", cmd_rtt_avg_ms[CONNPARAM_FAST]);
+    jw_uint(&j, "rtt_idle_ms", cmd_rtt_avg_ms[CONNPARAM_IDLE]);
+    jw_int(&j, "updates", connparam_updates);
+    jw_int(&j, "rejects", connparam_rejects);
+    jw_obj_end(&j);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, resp);
+    return ESP_OK;
+}
+
+// Event log: /api/log[?since=<seq>][&format=json]
+// Plain /api/log is text, newest line first. With since, only records after
+// that sequence are returned, oldest first; the X-Log-Next header (and "next"
+// in JSON) is the value to pass as since on the following request.
 static esp_err_t api_log(httpd_req_t *req) {
-    static char resp[WEB_LOG_SIZE + 64];
-    static char temp[WEB_LOG_SIZE + 64];
-    portENTER_CRITICAL(&log_mux);
-    // Copy log in order (oldest to newest)
-    int idx = 0;
-    for (int i = 0; i < WEB_LOG_SIZE; i++) {
-        int pos = (web_log_pos + i) % WEB_LOG_SIZE;
-        if (web_log[pos] != 0) {
-            temp[idx++] = web_log[pos];
+    char buf[48], param[12];
+    uint32_t since = 0;
+    bool delta = false, json = false;
+    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
+        if (httpd_query_key_value(buf, "since", param, sizeof(param)) == ESP_OK) {
+            since = strtoul(param, NULL, 10);
+            delta = true;
         }
+        json = httpd_query_key_value(buf, "format", param, sizeof(param)) == ESP_OK && strcmp(param, "json") == 0;
     }
-    temp[idx] = 0;
-    portEXIT_CRITICAL(&log_mux);
-    
-    // Reverse lines (newest first)
-    int resp_idx = 0;
-    int end = idx;
-    while (end > 0) {
-        // Find start of last line
-        int start = end - 1;
-        while (start > 0 && temp[start - 1] != '\n') start--;
-        // Copy this line
-        for (int j = start; j < end; j++) {
-            resp[resp_idx++] = temp[j];
-        }
-        if (start > 0 && temp[start - 1] == '\n') {
-            end = start - 1;
+    uint32_t head = ev_next_seq();
+    uint32_t oldest = head > EVLOG_SLOTS ? head - EVLOG_SLOTS : 1;
+    uint32_t from = since + 1 > oldest ? since + 1 : oldest;
+    if (since >= head) from = head;  // Client ahead of us (we rebooted): nothing new
+
+    // since is exclusive, so next is the last record served: passing it back
+    // resumes at head and back-to-back polls neither skip nor repeat a record
+    uint32_t last = head - 1;
+    char next[12], line[EV_LINE_LEN];
+    snprintf(next, sizeof(next), "%lu", (unsigned long)last);
+    chunk_writer_t w;
+    json_writer_t j;
+    ev_rec_t e;
+    cw_begin(&w, req, json ? "application/json" : "text/plain");
+    httpd_resp_set_hdr(req, "X-Log-Next", next);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (json) {
+        jw_init(&j, cw_sink, &w);
+        jw_obj(&j, NULL);
+        jw_uint(&j, "next", last);
+        jw_uint(&j, "lost", delta && from > since + 1 && since < head ? from - since - 1 : 0);
+        jw_arr(&j, "events");
+    }
+    bool first = true;
+    for (uint32_t i = 0; i < head - from; i++) {
+        uint32_t seq = delta || json ? from + i : head - 1 - i;
+        if (!ev_read(seq, &e)) continue;  // Overwritten while we were sending
+        if (json) {
+            ev_format(&e, line, sizeof(line));
+            jw_obj(&j, NULL);
+            jw_uint(&j, "seq", e.seq);
+            jw_uint(&j, "ms", e.ms);
+            jw_str(&j, "ev", ev_descs[e.id].key);
+            jw_str(&j, "msg", line);
+            jw_obj_end(&j);
         } else {
-            end = start;
+            if (!first) cw_write(&w, "\n", 1);
+            cw_write(&w, line, ev_format_line(&e, line, sizeof(line)));
+            first = false;
         }
-        if (end > 0) resp[resp_idx++] = '\n';
     }
-    resp[resp_idx] = 0;
-    
-    httpd_resp_set_type(req, "text/plain");
-    httpd_resp_send(req, resp, strlen(resp));
-    return ESP_OK;
+    if (json) {
+        jw_arr_end(&j);
+        jw_obj_end(&j);
+    }
+    return cw_end(&w);
+}
+
+// Command responses
+// Command endpoints never wait on the httpd task: the handler queues the BLE
+// write, detaches the request and returns. A worker answers once the write is
+// acked, rejected or timed out, with the outcome and its latency; a command
+// still queued for the link after HTTP_CMD_WAIT_MS is answered 202 "pending".
+// HTTP_CMD_WORKERS can be raised from build_flags.
+#ifndef HTTP_CMD_WORKERS
+#define HTTP_CMD_WORKERS 2
+#endif
+#if HTTP_CMD_WORKERS > CMD_WAITER_SLOTS
+#error "HTTP_CMD_WORKERS needs a cmd waiter slot each"
+#endif
+#define HTTP_CMD_QUEUE_LEN 2
+#define HTTP_CMD_WAIT_MS (CMD_WRITE_TIMEOUT_MS + 1000)
+#define HTTP_CMD_MEMBERS_LEN 96
+
+typedef struct {
+    httpd_req_t *req;  // Async copy; the worker completes it
+    uint32_t id;
+    char members[HTTP_CMD_MEMBERS_LEN];  // Endpoint-specific "key":value list
+} http_cmd_job_t;
+
+static QueueHandle_t http_cmd_queue = NULL;
+static volatile uint32_t http_cmd_busy = 0;  // Answered without waiting: no free worker
+
+static const char *http_cmd_status_line(cmd_status_t st) {
+    switch (st) {
+        case CMD_ST_OK: return "200 OK";
+        case CMD_ST_PENDING: return "202 Accepted";
+        case CMD_ST_SUPERSEDED: return "409 Conflict";
+        case CMD_ST_TIMEOUT: return "504 Gateway Timeout";
+        default: return "502 Bad Gateway";
+    }
+}
+
+// {"ok":..,"cmd":id,"status":..,"latency_ms":.., members}
+static esp_err_t http_cmd_respond(httpd_req_t *req, uint32_t id, const char *members, uint32_t wait_ms) {
+    cmd_result_t r = {.id = id, .status = id ? CMD_ST_PENDING : CMD_ST_FAILED};
+    bool done = id && ble_cmd_wait(id, wait_ms, &r);
+    char resp[192];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, resp, sizeof(resp));
+    jw_obj(&j, NULL);
+    jw_bool(&j, "ok", r.status == CMD_ST_OK);
+    jw_uint(&j, "cmd", id);
+    jw_str(&j, "status", cmd_status_str(r.status));
+    if (done) jw_uint(&j, "latency_ms", r.latency_ms);
+    if (r.status == CMD_ST_FAILED && r.att_status) jw_int(&j, "att_status", r.att_status);
+    jw_members(&j, members);
+    jw_obj_end(&j);
+    httpd_resp_set_status(req, http_cmd_status_line(r.status));
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, resp, json_buf_ok(&b) ? b.len : (int)sizeof(resp) - 1);
+}
+
+// Hand the request to a worker; with none free, answer "pending" right away.
+// Only the httpd task enqueues, so a free queue slot cannot vanish in between.
+static esp_err_t http_cmd_reply(httpd_req_t *req, uint32_t id, const char *members) {
+    http_cmd_job_t job = {.id = id};
+    snprintf(job.members, sizeof(job.members), "%s", members);
+    if (id && http_cmd_queue && uxQueueSpacesAvailable(http_cmd_queue) &&
+        httpd_req_async_handler_begin(req, &job.req) == ESP_OK) {
+        xQueueSend(http_cmd_queue, &job, 0);
+        return ESP_OK;
+    }
+    if (id) http_cmd_busy++;
+    return http_cmd_respond(req, id, members, 0);
+}
+
+static void http_cmd_task(void *arg) {
+    http_cmd_job_t job;
+    while (1) {
+        xQueueReceive(http_cmd_queue, &job, portMAX_DELAY);
+        http_cmd_respond(job.req, job.id, job.members, HTTP_CMD_WAIT_MS);
+        httpd_req_async_handler_complete(job.req);
+    }
+}
+
+static void http_cmd_init(void) {
+    http_cmd_queue = xQueueCreate(HTTP_CMD_QUEUE_LEN, sizeof(http_cmd_job_t));
+    for (int i = 0; i < HTTP_CMD_WORKERS; i++) {
+        xTaskCreate(http_cmd_task, "http_cmd", 3072, NULL, 4, NULL);
+    }
 }
 
 static esp_err_t api_eco(httpd_req_t *req) {
-    pending_mode = 1;
-    if (ble_connected && chars_discovered) process_pending_commands();
-    httpd_resp_sendstr(req, "{\"ok\":true}");
-    return ESP_OK;
+    return http_cmd_reply(req, ble_cmd_set_mode(1), "");
 }
 
 static esp_err_t api_tour(httpd_req_t *req) {
-    pending_mode = 2;
-    if (ble_connected && chars_discovered) process_pending_commands();
-    httpd_resp_sendstr(req, "{\"ok\":true}");
-    return ESP_OK;
+    return http_cmd_reply(req, ble_cmd_set_mode(2), "");
 }
 
 static esp_err_t api_boost(httpd_req_t *req) {
-    pending_mode = 3;
-    if (ble_connected && chars_discovered) process_pending_commands();
-    httpd_resp_sendstr(req, "{\"ok\":true}");
-    return ESP_OK;
+    return http_cmd_reply(req, ble_cmd_set_mode(3), "");
 }
 
+// Timed rocking; sessions over ROCK_SEGMENT_MAX_MIN are chained segments
 static esp_err_t api_rock_start(httpd_req_t *req) {
+    bridge_state_t st;
+    state_get(&st);
+    int minutes = st.rock_minutes;
     // Parse query string for minutes and intensity
     char buf[64];
     if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
         char param[16];
         if (httpd_query_key_value(buf, "min", param, sizeof(param)) == ESP_OK) {
             int m = atoi(param);
-            if (m >= 0 && m <= 30) rock_minutes = m;
+            if (m >= 0 && m <= ROCK_SESSION_MAX_MIN) minutes = m;
         }
         if (httpd_query_key_value(buf, "intensity", param, sizeof(param)) == ESP_OK) {
             int i = atoi(param);
-            if (i >= 0 && i <= 100) rock_intensity = i;
+            if (i >= 0 && i <= 100) st.intensity = i;
         }
     }
-    pending_rock_start = 1;
-    if (ble_connected && chars_discovered) process_pending_commands();
-    char resp[80];
-    snprintf(resp, 80, "{\"ok\":true,\"minutes\":%d,\"intensity\":%d}", rock_minutes, rock_intensity);
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, resp);
-    return ESP_OK;
+    bridge_state_t *s = state_begin();
+    s->intensity = st.intensity;
+    s->auto_renew = false;
+    state_end();
+    uint32_t id = rock_session_start(minutes);
+    mqtt_publish_state();
+    char members[HTTP_CMD_MEMBERS_LEN];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, members, sizeof(members));
+    jw_int(&j, "minutes", minutes);
+    jw_int(&j, "intensity", st.intensity);
+    return http_cmd_reply(req, id, members);
 }
 
 // Continuous rocking (no timer)
 static esp_err_t api_rock_continuous(httpd_req_t *req) {
+    int intensity = -1;
     char buf[32];
     if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
         char param[16];
         if (httpd_query_key_value(buf, "intensity", param, sizeof(param)) == ESP_OK) {
             int i = atoi(param);
-            if (i >= 0 && i <= 100) rock_intensity = i;
+            if (i >= 0 && i <= 100) intensity = i;
         }
     }
-    rock_minutes = 0;  // 0 = continuous
-    pending_rock_start = 1;
-    if (ble_connected && chars_discovered) process_pending_commands();
+    bridge_state_t *s = state_begin();
+    if (intensity >= 0) s->intensity = intensity;
+    s->auto_renew = false;
+    intensity = s->intensity;
+    state_end();
+    uint32_t id = rock_session_start(0);  // 0 = continuous
     mqtt_publish_state();
-    char resp[80];
-    snprintf(resp, 80, "{\"ok\":true,\"continuous\":true,\"intensity\":%d}", rock_intensity);
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, resp);
-    return ESP_OK;
+    char members[HTTP_CMD_MEMBERS_LEN];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, members, sizeof(members));
+    jw_bool(&j, "continuous", true);
+    jw_int(&j, "intensity", intensity);
+    return http_cmd_reply(req, id, members);
 }
 
-// Auto-renew rocking: 30 min, renews at 10 min remaining
+// Auto-renew rocking: 30 min segments, chained until stopped
 static esp_err_t api_rock_autorenew(httpd_req_t *req) {
+    int intensity = -1;
     char buf[32];
     if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
         char param[16];
         if (httpd_query_key_value(buf, "intensity", param, sizeof(param)) == ESP_OK) {
             int i = atoi(param);
-            if (i >= 0 && i <= 100) rock_intensity = i;
+            if (i >= 0 && i <= 100) intensity = i;
         }
     }
-    rock_minutes = 30;  // Start with 30 min
-    auto_renew_enabled = true;
-    rock_start_time = esp_timer_get_time() / 1000000;  // Current time in seconds
-    pending_rock_start = 1;
-    if (ble_connected && chars_discovered) process_pending_commands();
+    bridge_state_t *s = state_begin();
+    if (intensity >= 0) s->intensity = intensity;
+    s->auto_renew = true;
+    intensity = s->intensity;
+    state_end();
+    uint32_t id = rock_session_start(ROCK_SEGMENT_MAX_MIN);
     mqtt_publish_state();
-    char resp[100];
-    snprintf(resp, 100, "{\"ok\":true,\"autorenew\":true,\"duration\":30,\"threshold\":10,\"intensity\":%d}", rock_intensity);
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, resp);
-    return ESP_OK;
+    char members[HTTP_CMD_MEMBERS_LEN];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, members, sizeof(members));
+    jw_bool(&j, "autorenew", true);
+    jw_int(&j, "duration", ROCK_SEGMENT_MAX_MIN);
+    jw_int(&j, "renew_lead_s", ROCK_RENEW_LEAD_S);
+    jw_int(&j, "intensity", intensity);
+    return http_cmd_reply(req, id, members);
 }
 
 static esp_err_t api_rock_stop(httpd_req_t *req) {
-    pending_rock_stop = 1;
-    auto_renew_enabled = false;  // Stop auto-renew when stopping
-    if (ble_connected && chars_discovered) process_pending_commands();
+    uint32_t id = rock_session_stop();  // Also ends auto-renew
     mqtt_publish_state();
-    httpd_resp_sendstr(req, "{\"ok\":true}");
-    return ESP_OK;
+    return http_cmd_reply(req, id, "");
 }
 
 static esp_err_t api_disconnect(httpd_req_t *req) {
@@ -1174,34 +3883,22 @@ static esp_err_t api_disconnect(httpd_req_t *req) {
     return ESP_OK;
 }
 
-// Config page - entity name settings
-static esp_err_t config_handler(httpd_req_t *req) {
-    static char html[3072];
-    snprintf(html, sizeof(html),
-        "<!DOCTYPE html><html><head><meta charset=UTF-8><meta name=viewport content=\"width=device-width,initial-scale=1\">"
-        "<title>Configuration</title><style>*{box-sizing:border-box}body{font-family:Arial;max-width:400px;margin:auto;padding:10px;background:#1a1a2e;color:#eee}"
-        "input{width:100%%;padding:8px;margin:4px 0;border-radius:4px;border:1px solid #444;background:#16213e;color:#eee}"
-        ".b{padding:12px 20px;margin:10px 0;border:none;border-radius:6px;cursor:pointer;background:#4CAF50;color:white;width:100%%}"
-        ".info{background:#16213e;padding:12px;border-radius:6px;margin-bottom:15px;font-size:13px;line-height:1.5}"
-        "label{display:block;margin-top:10px;font-size:13px;color:#888}"
-        "</style></head><body><h2>⚙️ Configuration</h2>"
-        "<div class=info>These names are used for Home Assistant MQTT discovery. "
-        "Change them to customize how entities appear in HA. For example, use your language or add room names. "
-        "Changes take effect after saving and will update entity names in Home Assistant.</div>"
-        "<form action=/api/config method=POST>"
-        "<label>Device name:</label><input name=device value=\"%s\" placeholder=\"e.g. Cybex E-Priam\">"
-        "<label>Battery sensor:</label><input name=battery value=\"%s\" placeholder=\"e.g. Battery\">"
-        "<label>Rocking switch:</label><input name=rocking value=\"%s\" placeholder=\"e.g. Rocking\">"
-        "<label>Auto-renew switch:</label><input name=autorenew value=\"%s\" placeholder=\"e.g. Auto-renew\">"
-        "<label>Drive mode select:</label><input name=mode value=\"%s\" placeholder=\"e.g. Mode\">"
-        "<label>Intensity number:</label><input name=intensity value=\"%s\" placeholder=\"e.g. Intensity\">"
-        "<label>Connection status:</label><input name=connected value=\"%s\" placeholder=\"e.g. Connected\">"
-        "<button class=b type=submit>💾 Save</button></form>"
-        "<a href=/><button class=b style=background:#666>← Back</button></a></body></html>",
-        name_device, name_battery, name_rocking, name_autorenew, name_mode, name_intensity, name_connected);
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, html, strlen(html));
-    return ESP_OK;
+// Current settings for the /config page
+static esp_err_t api_config_get(httpd_req_t *req) {
+    char *const names[] = {name_device, name_battery, name_rocking, name_autorenew, name_mode, name_intensity, name_connected};
+    const char *const keys[] = {"device", "battery", "rocking", "autorenew", "mode", "intensity", "connected"};
+    chunk_writer_t w;
+    json_writer_t j;
+    cw_begin(&w, req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    jw_init(&j, cw_sink, &w);
+    jw_obj(&j, NULL);
+    for (int i = 0; i < 7; i++) jw_str(&j, keys[i], names[i]);
+    jw_bool(&j, "json_state", mqtt_json_state);
+    jw_bool(&j, "dev_disc", mqtt_device_discovery);
+    jw_bool(&j, "persist", mqtt_persistent);
+    jw_obj_end(&j);
+    return cw_end(&w);
 }
 
 // URL decode helper
@@ -1263,8 +3960,19 @@ static esp_err_t api_config_post(httpd_req_t *req) {
             strncpy(name_connected, decoded, sizeof(name_connected) - 1);
         }
         
+        // Unchecked boxes are not posted
+        bool json = httpd_query_key_value(buf, "json_state", val, sizeof(val)) == ESP_OK;
+        if (json != mqtt_json_state) {
+            mqtt_json_state = json;
+            mqtt_shadow_stale = true;
+        }
+        mqtt_device_discovery = httpd_query_key_value(buf, "dev_disc", val, sizeof(val)) == ESP_OK;
+        // Client config is fixed at init; takes effect after a restart
+        mqtt_persistent = httpd_query_key_value(buf, "persist", val, sizeof(val)) == ESP_OK;
+        
         save_entity_names();
-        mqtt_publish_discovery();  // Re-publish with new names
+        mqtt_publish_discovery(false);  // Re-published only if names or layout changed
+        mqtt_publish_state();
     }
     
     // Redirect back to config page
@@ -1276,27 +3984,108 @@ static esp_err_t api_config_post(httpd_req_t *req) {
 
 static esp_err_t api_debug(httpd_req_t *req) {
     char addr_str[18] = "none";
-    if (priam_found || ble_connected) {
-        snprintf(addr_str, sizeof(addr_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-            priam_addr.val[5], priam_addr.val[4], priam_addr.val[3],
-            priam_addr.val[2], priam_addr.val[1], priam_addr.val[0]);
-    }
-    char r[900];
-    snprintf(r, 900, 
-        "{\"scan_cycles\":%d,\"priam_found\":%s,"
-        "\"priam_addr\":\"%s\",\"priam_addr_type\":%d,"
-        "\"ble_connected\":%s,\"conn_handle\":%d,"
-        "\"service_found\":%s,\"chars_discovered\":%s,"
-        "\"h_status\":%d,\"h_mode\":%d,\"h_rock\":%d,\"h_led\":%d,"
-        "\"last_write_rc\":%d,\"last_write_status\":%d,\"pending_mode\":%d}",
-        scan_cycle_count, priam_found ? "true" : "false",
-        addr_str, priam_addr.type,
-        ble_connected ? "true" : "false", conn_handle,
-        service_found ? "true" : "false", chars_discovered ? "true" : "false",
-        status_val_handle, drive_mode_val_handle, rocking_val_handle, battery_led_val_handle,
-        last_write_rc, last_write_status, pending_mode);
+    if (priam_found || ble_connected) addr_to_str(&priam_addr, addr_str);
+    chunk_writer_t w;
+    json_writer_t j;
+    cw_begin(&w, req, "application/json");
+    jw_init(&j, cw_sink, &w);
+    jw_obj(&j, NULL);
+    jw_int(&j, "scan_cycles", scan_cycle_count);
+    jw_bool(&j, "priam_found", priam_found);
+    jw_str(&j, "priam_addr", addr_str);
+    jw_int(&j, "priam_addr_type", priam_addr.type);
+    jw_bool(&j, "ble_connected", ble_connected);
+    jw_int(&j, "conn_handle", conn_handle);
+    jw_bool(&j, "service_found", service_found);
+    jw_bool(&j, "chars_discovered", chars_discovered);
+    jw_int(&j, "h_status", status_val_handle);
+    jw_int(&j, "h_mode", drive_mode_val_handle);
+    jw_int(&j, "h_rock", rocking_val_handle);
+    jw_int(&j, "h_led", battery_led_val_handle);
+    jw_int(&j, "last_write_rc", last_write_rc);
+    jw_int(&j, "last_write_status", last_write_status);
+    jw_arr(&j, "pending");
+    jw_uint(&j, NULL, cmd_slot[CMD_CHR_MODE].id);
+    jw_uint(&j, NULL, cmd_slot[CMD_CHR_ROCK].id);
+    jw_arr_end(&j);
+    jw_uint(&j, "last_cmd", cmd_last_result.id);
+    jw_str(&j, "last_cmd_result", cmd_status_str(cmd_last_result.status));
+    jw_uint(&j, "last_cmd_ms", cmd_last_result.latency_ms);
+    jw_str(&j, "conn_state", conn_state_names[conn_state]);
+    jw_uint(&j, "conn_state_ms", conn_state_ms());
+    jw_int(&j, "conn_attempt", conn_attempt);
+    jw_uint(&j, "backoff_ms", conn_backoff_ms);
+    jw_int(&j, "last_reason", conn_last_reason);
+    jw_int(&j, "boot_to_ready_ms", conn_boot_to_ready_ms);
+    jw_int(&j, "connect_to_ready_ms", conn_to_ready_ms);
+    jw_bool(&j, "handles_cached", handles_from_cache);
+    jw_bool(&j, "peer_cached", peer_cache_valid);
+    jw_int(&j, "cache_hits", peer_cache_hits);
+    jw_int(&j, "cache_misses", peer_cache_misses);
+    jw_str(&j, "scan_mode", scan_mode_names[scan_mode]);
+    jw_uint(&j, "adv_rx", scan_adv_rx);
+    jw_uint(&j, "adv_parsed", scan_adv_parsed);
+    jw_uint(&j, "mqtt_sent", mqtt_pub_sent);
+    jw_uint(&j, "mqtt_suppressed", mqtt_pub_suppressed);
+    jw_int(&j, "mqtt_connect_to_state_ms", mqtt_connect_to_state_ms);
+    jw_int(&j, "mqtt_outbox", mqtt_client ? esp_mqtt_client_get_outbox_size(mqtt_client) : 0);
+    jw_uint(&j, "cmd_expired", cmd_expired);
+    jw_uint(&j, "status_version", status_version);
+    jw_uint(&j, "status_304", status_not_modified);
+    jw_uint(&j, "sse_dropped", sse_dropped);
+    jw_uint(&j, "http_cmd_busy", http_cmd_busy);
+    jw_uint(&j, "state_version", state.version);
+    jw_uint(&j, "rock_renewals", rock_renewals);
+    jw_uint(&j, "rock_corrections", rock_corrections);
+    jw_str(&j, "session_restored_from", session_restored_from);
+    jw_int(&j, "session_offline_ms", session_offline_ms);
+    jw_int(&j, "session_recover_ms", session_recover_ms);
+    jw_uint(&j, "session_nvs_writes", session_nvs_writes);
+    jw_uint(&j, "conn_itvl_us", (unsigned long)conn_itvl * 1250);
+    jw_int(&j, "conn_latency", conn_latency);
+    jw_uint(&j, "conn_timeout_ms", (unsigned long)conn_timeout * 10);
+    jw_uint(&j, "cmd_rtt_ms", cmd_rtt_ms);
+    jw_arr(&j, "cccd");
+    jw_int(&j, NULL, status_cccd_handle);
+    jw_int(&j, NULL, drive_mode_cccd_handle);
+    jw_int(&j, NULL, rocking_cccd_handle);
+    jw_arr_end(&j);
+    jw_obj(&j, "setup_ms");
+    for (int i = 0; i < SETUP_PHASES; i++) jw_uint(&j, setup_phase_names[i], setup_phase_ms[i]);
+    jw_obj_end(&j);
+    jw_obj_end(&j);
+    return cw_end(&w);
+}
+
+// Log levels: /api/loglevel?<subsystem>=<level>[&...] or ?all=<level>
+// Levels: none, error, warn, info, debug, verbose. Also reports the deferred
+// logger's counters (dlog_call_us / dlog_calls is the mean cost to the caller).
+static esp_err_t api_loglevel(httpd_req_t *req) {
+    char buf[96], param[12];
+    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
+        if (httpd_query_key_value(buf, "all", param, sizeof(param)) == ESP_OK) log_level_set(NULL, param);
+        for (int i = 0; i < LOG_SUB_COUNT; i++) {
+            if (httpd_query_key_value(buf, log_sub_names[i], param, sizeof(param)) == ESP_OK) {
+                log_level_set(log_sub_names[i], param);
+            }
+        }
+    }
+    char resp[256];
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, resp, sizeof(resp));
+    jw_obj(&j, NULL);
+    jw_obj(&j, "levels");
+    for (int i = 0; i < LOG_SUB_COUNT; i++) jw_str(&j, log_sub_names[i], log_level_names[log_levels[i]]);
+    jw_obj_end(&j);
+    jw_bool(&j, "deferred", DLOG_DEFERRED);
+    jw_uint(&j, "dlog_calls", dlog_calls);
+    jw_uint(&j, "dlog_call_us", dlog_call_us);
+    jw_uint(&j, "dlog_suppressed", dlog_suppressed);
+    jw_uint(&j, "dlog_dropped", dlog_dropped);
+    jw_obj_end(&j);
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, r, strlen(r));
+    httpd_resp_sendstr(req, resp);
     return ESP_OK;
 }
 
@@ -1304,33 +4093,6 @@ static esp_err_t api_debug(httpd_req_t *req) {
 static esp_ota_handle_t ota_handle = 0;
 static const esp_partition_t *ota_partition = NULL;
 
-static esp_err_t ota_page_handler(httpd_req_t *req) {
-    const char *html = 
-        "<!DOCTYPE html><html><head><meta charset=UTF-8><meta name=viewport content='width=device-width,initial-scale=1'>"
-        "<title>OTA Update</title><style>body{font-family:Arial;max-width:400px;margin:auto;padding:20px;background:#1a1a2e;color:#eee}"
-        ".c{background:#16213e;padding:20px;border-radius:8px;margin:10px 0}input[type=file]{margin:10px 0}"
-        ".b{padding:12px 24px;border:none;border-radius:6px;cursor:pointer;background:#4CAF50;color:white;font-size:16px}"
-        "#p{width:100%;height:20px;background:#333;border-radius:10px;margin:10px 0}#pb{height:100%;background:#4CAF50;border-radius:10px;width:0%;transition:width 0.3s}"
-        "</style></head><body><h2>🔄 OTA Update</h2>"
-        "<div class=c><form id=f><input type=file name=fw id=fw accept='.bin'><br>"
-        "<div id=p style='display:none'><div id=pb></div></div>"
-        "<div id=st></div><br><button type=submit class=b>Upload Firmware</button></form></div>"
-        "<div class=c><a href='/'>← Back</a></div>"
-        "<script>"
-        "document.getElementById('f').onsubmit=async e=>{"
-        "e.preventDefault();let f=document.getElementById('fw').files[0];if(!f)return alert('Select a file');"
-        "document.getElementById('p').style.display='block';document.getElementById('st').textContent='Uploading...';"
-        "let xhr=new XMLHttpRequest();xhr.open('POST','/api/ota',true);"
-        "xhr.upload.onprogress=e=>{if(e.lengthComputable){let p=Math.round(e.loaded/e.total*100);document.getElementById('pb').style.width=p+'%';document.getElementById('st').textContent=p+'%';}};"
-        "xhr.onload=()=>{if(xhr.status==200){document.getElementById('st').textContent='OK! Restarting...';setTimeout(()=>location.href='/',5000);}else{document.getElementById('st').textContent='Error: '+xhr.responseText;}};"
-        "xhr.onerror=()=>{document.getElementById('st').textContent='Network error';};"
-        "xhr.send(f);};"
-        "</script></body></html>";
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, html, strlen(html));
-    return ESP_OK;
-}
-
 static esp_err_t ota_upload_handler(httpd_req_t *req) {
     char buf[1024];
     int received, remaining = req->content_len;
@@ -1338,7 +4100,7 @@ static esp_err_t ota_upload_handler(httpd_req_t *req) {
     esp_err_t err;
     
     ESP_LOGI(TAG, "OTA: Starting, size=%d", remaining);
-    web_log_add("OTA: Starting, %d bytes", remaining);
+    ev_log(EV_OTA_START, NULL, remaining, 0, NULL);
     
     while (remaining > 0) {
         received = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf)));
@@ -1392,7 +4154,7 @@ static esp_err_t ota_upload_handler(httpd_req_t *req) {
     }
     
     ESP_LOGI(TAG, "OTA: Success! Restarting...");
-    web_log_add("OTA: Success! Rebooting...");
+    ev_log(EV_OTA_DONE, NULL, 0, 0, NULL);
     httpd_resp_sendstr(req, "OK");
     
     vTaskDelay(pdMS_TO_TICKS(1000));
@@ -1400,20 +4162,38 @@ static esp_err_t ota_upload_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
+// Requests that hold a socket open (SSE, parked long-polls, queued commands)
+// must leave room for the UI, the API and OTA. httpd needs 3 sockets of its
+// own and MQTT one, so CONFIG_LWIP_MAX_SOCKETS is 16.
+#define HTTP_MAX_SOCKETS 12
+#define HTTP_HELD_SOCKETS (SSE_MAX_CLIENTS + STATUS_WAITERS + HTTP_CMD_WORKERS + HTTP_CMD_QUEUE_LEN)
+_Static_assert(HTTP_HELD_SOCKETS <= HTTP_MAX_SOCKETS - 4, "long-lived requests could lock out the UI");
+
 static void start_webserver(void) {
+    web_assets_init();
     httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
-    cfg.max_uri_handlers = 24;
+    cfg.max_uri_handlers = 32;
+    cfg.max_open_sockets = HTTP_MAX_SOCKETS;
+    cfg.lru_purge_enable = true;  // A new client closes the idlest socket instead of being refused
     if (httpd_start(&server, &cfg) == ESP_OK) {
-        httpd_uri_t h = {"/", HTTP_GET, root_handler, NULL};
+        httpd_uri_t h = {"/", HTTP_GET, web_asset_handler, &web_assets[WEB_INDEX]};
         httpd_register_uri_handler(server, &h);
-        h = (httpd_uri_t){"/ota", HTTP_GET, ota_page_handler, NULL};
+        h = (httpd_uri_t){"/app.js", HTTP_GET, web_asset_handler, &web_assets[WEB_JS]};
+        httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/app.css", HTTP_GET, web_asset_handler, &web_assets[WEB_CSS]};
+        httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/ota", HTTP_GET, web_asset_handler, &web_assets[WEB_OTA]};
         httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/ota", HTTP_POST, ota_upload_handler, NULL};
         httpd_register_uri_handler(server, &h);
-        h = (httpd_uri_t){"/config", HTTP_GET, config_handler, NULL};
+        h = (httpd_uri_t){"/config", HTTP_GET, web_asset_handler, &web_assets[WEB_CONFIG]};
+        httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/config", HTTP_GET, api_config_get, NULL};
         httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/config", HTTP_POST, api_config_post, NULL};
         httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/loglevel", HTTP_GET, api_loglevel, NULL};
+        httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/status", HTTP_GET, api_status, NULL};
         httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/debug", HTTP_GET, api_debug, NULL};
@@ -1436,13 +4216,22 @@ static void start_webserver(void) {
         httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/rescan", HTTP_GET, api_rescan, NULL};
         httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/connparams", HTTP_GET, api_connparams, NULL};
+        httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/scan", HTTP_GET, api_scan, NULL};
+        httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/scan/config", HTTP_GET, api_scan_config, NULL};
+        httpd_register_uri_handler(server, &h);
         h = (httpd_uri_t){"/api/log", HTTP_GET, api_log, NULL};
         httpd_register_uri_handler(server, &h);
+        h = (httpd_uri_t){"/api/events", HTTP_GET, api_events, NULL};
+        httpd_register_uri_handler(server, &h);
         ESP_LOGI(TAG, "HTTP started");
     }
 }
 
 void app_main(void) {
+    dlog_init();
     ESP_LOGI(TAG, "E-Priam Bridge v2.1 + MQTT");
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -1450,14 +4239,17 @@ void app_main(void) {
         nvs_flash_init();
     }
     load_entity_names();
+    load_peer_cache();
     wifi_init();
+    // BLE first so a restored session is re-issued without waiting for WiFi
+    rock_session_init();
+    ble_cmd_init();
+    session_restore();
+    ble_init();
     xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+    sse_init();
+    http_cmd_init();
     start_webserver();
     mqtt_init();
-    ble_init();
-    
-    // Start auto-renew monitoring task
-    xTaskCreate(auto_renew_task, "autorenew", 2048, NULL, 5, NULL);
-    
     ESP_LOGI(TAG, "Ready!");
 }
@@ -0,0 +1,157 @@
+/*
+ * Host benchmark: JSON writer (src/json_writer.h) vs the snprintf rendering it
+ * replaced, on the /api/status document and the MQTT JSON state document.
+ * Reports bytes/s and the stack each renderer touches (including the 560-byte
+ * output buffer both use, as status_doc does).
+ *
+ * Build and run from the repository root:
+ *   cc -O2 -Isrc -o bench_json tools/bench_json.c -lpthread && ./bench_json
+ *
+ * Host numbers only compare the two approaches; the C6 is far slower in
+ * absolute terms.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "json_writer.h"
+
+#define ITERATIONS 2000000
+#define PROBE_STACK (64 * 1024)
+#define PAINT 0xA5
+
+static volatile int sink_len;  // Keeps the renders from being optimised away
+
+// Same values as a live link with a timed session running
+static const int st[] = {1, 1, 69, 3, 2, 1, 0, 5, 30, 80, 1200, 1754};
+static const char *const st_keys[] = {
+    "connected", "mqtt", "battery", "battery_leds", "drive_mode", "rocking", "auto_renew", "intensity",
+    "rock_minutes", "link_quality", "link_detect_ms", "remaining_sec",
+};
+
+static const char *const ent_keys[] = {"battery", "rocking", "autorenew", "mode", "duration",
+                                       "intensity", "connected", "link", "remaining", "ip"};
+static const char *const ent_vals[] = {"69", "ON", "OFF", "TOUR", "30 min", "5", "ON", "80", "1754", "192.168.1.57"};
+static const int ent_numeric[] = {1, 0, 0, 0, 0, 1, 0, 1, 1, 0};
+#define ENT_COUNT 10
+
+static int status_snprintf(char *out, size_t len) {
+    return snprintf(out, len,
+        "{\"version\":%lu,\"connected\":%s,\"mqtt\":%s,\"battery\":%d,\"battery_leds\":%d,\"drive_mode\":%d,"
+        "\"rocking\":%s,\"auto_renew\":%s,\"intensity\":%d,\"remaining_sec\":%d,\"rock_minutes\":%d,"
+        "\"link_quality\":%d,\"rssi\":%d,\"link_detect_ms\":%d}",
+        1234ul, st[0] ? "true" : "false", st[1] ? "true" : "false", st[2], st[3], st[4],
+        st[5] ? "true" : "false", st[6] ? "true" : "false", st[7], st[11], st[8], st[9], -67, st[10]);
+}
+
+static int status_jw(char *out, size_t len) {
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, out, len);
+    jw_obj(&j, NULL);
+    jw_uint(&j, "version", 1234);
+    jw_bool(&j, st_keys[0], st[0]);
+    jw_bool(&j, st_keys[1], st[1]);
+    jw_int(&j, st_keys[2], st[2]);
+    jw_int(&j, st_keys[3], st[3]);
+    jw_int(&j, st_keys[4], st[4]);
+    jw_bool(&j, st_keys[5], st[5]);
+    jw_bool(&j, st_keys[6], st[6]);
+    jw_int(&j, st_keys[7], st[7]);
+    jw_int(&j, st_keys[11], st[11]);
+    jw_int(&j, st_keys[8], st[8]);
+    jw_int(&j, st_keys[9], st[9]);
+    jw_int(&j, "rssi", -67);
+    jw_int(&j, st_keys[10], st[10]);
+    jw_obj_end(&j);
+    return json_buf_ok(&b) ? b.len : -1;
+}
+
+static int state_snprintf(char *out, size_t len) {
+    int n = snprintf(out, len, "{");
+    for (int i = 0; i < ENT_COUNT && n < (int)len; i++) {
+        const char *fmt = ent_numeric[i] ? "%s\"%s\":%s" : "%s\"%s\":\"%s\"";
+        n += snprintf(out + n, len - n, fmt, i ? "," : "", ent_keys[i], ent_vals[i]);
+    }
+    if (n < (int)len) n += snprintf(out + n, len - n, "}");
+    return n < (int)len ? n : -1;
+}
+
+static int state_jw(char *out, size_t len) {
+    json_buf_t b;
+    json_writer_t j;
+    jw_init_buf(&j, &b, out, len);
+    jw_obj(&j, NULL);
+    for (int i = 0; i < ENT_COUNT; i++) {
+        if (ent_numeric[i]) jw_value(&j, ent_keys[i], ent_vals[i]);
+        else jw_str(&j, ent_keys[i], ent_vals[i]);
+    }
+    jw_obj_end(&j);
+    return json_buf_ok(&b) ? b.len : -1;
+}
+
+typedef struct {
+    const char *name;
+    int (*render)(char *out, size_t len);
+} bench_t;
+
+static const bench_t benches[] = {
+    {"status  snprintf", status_snprintf},
+    {"status  jw_*", status_jw},
+    {"state   snprintf", state_snprintf},
+    {"state   jw_*", state_jw},
+};
+
+static void *run_once(void *arg) {
+    char out[560];  // status_doc
+    sink_len = ((const bench_t *)arg)->render(out, sizeof(out));
+    return NULL;
+}
+
+static void *run_nothing(void *arg) {
+    return NULL;
+}
+
+// Run fn on a thread whose stack was painted, and count the bytes it changed
+static size_t stack_touched(void *(*fn)(void *), void *arg) {
+    uint8_t *stack = mmap(NULL, PROBE_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) return 0;
+    memset(stack, PAINT, PROBE_STACK);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, PROBE_STACK);
+    pthread_t t;
+    pthread_create(&t, &attr, fn, arg);
+    pthread_join(t, NULL);
+    pthread_attr_destroy(&attr);
+    size_t low = 0;
+    while (low < PROBE_STACK && stack[low] == PAINT) low++;
+    munmap(stack, PROBE_STACK);
+    return PROBE_STACK - low;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    size_t base = stack_touched(run_nothing, NULL);
+    printf("%-18s %8s %10s %12s %8s\n", "renderer", "bytes", "ns/doc", "MB/s", "stack");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const bench_t *b = &benches[i];
+        char out[560];
+        int len = b->render(out, sizeof(out));
+        double t0 = now_s();
+        for (int n = 0; n < ITERATIONS; n++) sink_len = b->render(out, sizeof(out));
+        double dt = now_s() - t0;
+        size_t stack = stack_touched(run_once, (void *)b);
+        printf("%-18s %8d %10.1f %12.1f %8zu\n", b->name, len, dt * 1e9 / ITERATIONS,
+               (double)len * ITERATIONS / dt / 1e6, stack > base ? stack - base : 0);
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+var ar=false,rs=0,rk=false,pt,E=i=>document.getElementById(i);
+function ap(d){
+if('connected'in d){E('sb').className=d.connected?'on':'off';E('scan').style.display=d.connected?'none':''}
+if('mqtt'in d)E('sm').className=d.mqtt?'on':'off';
+if('battery'in d)E('bt').textContent=d.battery>=0?d.battery+'%':'?';
+if('drive_mode'in d)E('md').textContent=['?','ECO','TOUR','BOOST'][d.drive_mode]||'?';
+if('rocking'in d)rk=d.rocking;if('remaining_sec'in d)rs=d.remaining_sec;
+if('auto_renew'in d){ar=d.auto_renew;E('au').className=ar?'on':'off'}
+E('rockbox').style.display=rk?'block':'none';E('abtn').style.background=ar?'#4CAF50':'#FF9800';upcd()}
+function st(){fetch('/api/status').then(r=>r.json()).then(ap)}
+function upcd(){if(!rk||rs<=0){E('cd').textContent='--:--';return}
+var m=Math.floor(rs/60),s=rs%60;E('cd').textContent=m+':'+(s<10?'0':'')+s}
+function upd(){fetch('/api/log').then(r=>r.text()).then(t=>{E('log').textContent=t})}
+document.querySelectorAll('[data-api]').forEach(b=>b.onclick=()=>fetch(b.dataset.api));
+E('scan').onclick=()=>fetch('/api/rescan');
+upd();setInterval(()=>{if(rk&&rs>0){rs--;upcd()}},1000);
+var es=new EventSource('/api/events');es.addEventListener('state',e=>ap(JSON.parse(e.data)));
+es.addEventListener('log',e=>{var l=E('log');l.textContent=(e.data+'\n'+l.textContent).slice(0,2500)});
+es.onerror=()=>{if(es.readyState==2&&!pt){st();pt=setInterval(st,10000)}};